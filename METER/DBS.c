@@ -0,0 +1,333 @@
+/*
+ DBS.c
+ 2016-02-10
+ Public Domain
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <sqlite3.h>
+
+#include "DBS.h"
+
+/* PRIVATE ---------------------------------------------------------------- */
+
+typedef struct
+{
+    uint64_t micros;
+    uint64_t value;
+    uint32_t meter;
+} DBS_sample_t;
+
+typedef struct
+{
+    DBS_sample_t *data;
+    int count;
+    int size;
+} DBS_queue_t;
+
+struct _DBS_s
+{
+    sqlite3 *db;
+    sqlite3_stmt *insert;
+    
+    pthread_t thread;
+    int started;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int stop;
+    
+    DBS_queue_t adding;     /* caller's, since the last flush */
+    DBS_queue_t pending;    /* flushed, for the writer to take */
+    DBS_queue_t writing;    /* writer's */
+    
+    uint64_t written;       /* under mutex */
+    uint64_t dropped;
+};
+
+static int _queue_grow(DBS_queue_t *q, int count)
+{
+    DBS_sample_t *p;
+    int size;
+    
+    if (count <= q->size) return 0;
+    
+    size = q->size ? q->size : 64;
+    
+    while (size < count) size *= 2;
+    
+    p = realloc(q->data, size * sizeof(DBS_sample_t));
+    
+    if (!p) return -1;
+    
+    q->data = p;
+    q->size = size;
+    
+    return 0;
+}
+
+/* moves the samples of src to the end of dst, returns how many fell off */
+
+static int _queue_move(DBS_queue_t *dst, DBS_queue_t *src)
+{
+    DBS_queue_t tmp;
+    int n;
+    
+    if (!dst->count)
+    {
+        tmp = *dst;
+        *dst = *src;
+        *src = tmp;
+        return 0;
+    }
+    
+    n = src->count;
+    
+    if (n > DBS_QUEUE_MAX - dst->count) n = DBS_QUEUE_MAX - dst->count;
+    
+    if (_queue_grow(dst, dst->count + n) < 0) n = 0;
+    
+    memcpy(dst->data + dst->count, src->data, n * sizeof(DBS_sample_t));
+    dst->count += n;
+    
+    n = src->count - n;
+    src->count = 0;
+    
+    return n;
+}
+
+static int _exec(DBS_t *self, const char *sql)
+{
+    char *err = NULL;
+    
+    if (sqlite3_exec(self->db, sql, NULL, NULL, &err) == SQLITE_OK) return 0;
+    
+    fprintf(stderr, "db: %s, %s\n", sql, err ? err : "failed");
+    
+    sqlite3_free(err);
+    
+    return -1;
+}
+
+/* one transaction for the lot, rolled back if any insert fails */
+
+static int _write(DBS_t *self, DBS_queue_t *q)
+{
+    DBS_sample_t *s;
+    int i;
+    
+    if (_exec(self, "BEGIN") < 0) return -1;
+    
+    for (i=0; i<q->count; i++)
+    {
+        s = &q->data[i];
+        
+        sqlite3_bind_int64(self->insert, 1, s->meter);
+        sqlite3_bind_int64(self->insert, 2, (sqlite3_int64)s->micros);
+        sqlite3_bind_int64(self->insert, 3, (sqlite3_int64)s->value);
+        
+        if (sqlite3_step(self->insert) != SQLITE_DONE)
+        {
+            fprintf(stderr, "db: insert failed, %s\n", sqlite3_errmsg(self->db));
+            sqlite3_reset(self->insert);
+            _exec(self, "ROLLBACK");
+            return -1;
+        }
+        
+        sqlite3_reset(self->insert);
+    }
+    
+    if (_exec(self, "COMMIT") < 0)
+    {
+        _exec(self, "ROLLBACK");
+        return -1;
+    }
+    
+    return 0;
+}
+
+static void *_writer(void *arg)
+{
+    DBS_t *self = arg;
+    DBS_queue_t tmp;
+    int err;
+    
+    pthread_mutex_lock(&self->mutex);
+    
+    while (1)
+    {
+        while (!self->pending.count && !self->stop)
+            pthread_cond_wait(&self->cond, &self->mutex);
+        
+        if (!self->pending.count) break;
+        
+        tmp = self->writing;
+        self->writing = self->pending;
+        self->pending = tmp;
+        
+        pthread_mutex_unlock(&self->mutex);
+        
+        err = _write(self, &self->writing);
+        
+        pthread_mutex_lock(&self->mutex);
+        
+        if (err) self->dropped += self->writing.count;
+        else     self->written += self->writing.count;
+        
+        self->writing.count = 0;
+    }
+    
+    pthread_mutex_unlock(&self->mutex);
+    
+    return NULL;
+}
+
+/* PUBLIC ----------------------------------------------------------------- */
+
+DBS_t *DBS(const char *path)
+{
+    DBS_t *self;
+    
+    self = calloc(1, sizeof(DBS_t));
+    
+    if (!self) return NULL;
+    
+    pthread_mutex_init(&self->mutex, NULL);
+    pthread_cond_init(&self->cond, NULL);
+    
+    if (sqlite3_open_v2(path, &self->db,
+           SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "db: can't open %s, %s\n", path,
+           self->db ? sqlite3_errmsg(self->db) : "out of memory");
+        DBS_cancel(self);
+        return NULL;
+    }
+    
+    /* readers don't block the writer, and commits sync at checkpoints */
+    
+    sqlite3_busy_timeout(self->db, 5000);
+    
+    if ((_exec(self, "PRAGMA journal_mode=WAL") < 0) ||
+        (_exec(self, "PRAGMA synchronous=NORMAL") < 0) ||
+        (_exec(self, "CREATE TABLE IF NOT EXISTS samples ("
+                     "meter INTEGER NOT NULL, "
+                     "time INTEGER NOT NULL, "
+                     "value INTEGER NOT NULL, "
+                     "PRIMARY KEY (meter, time)) WITHOUT ROWID") < 0))
+    {
+        DBS_cancel(self);
+        return NULL;
+    }
+    
+    if (sqlite3_prepare_v2(self->db,
+           "INSERT OR REPLACE INTO samples (meter, time, value) VALUES (?, ?, ?)",
+           -1, &self->insert, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "db: %s\n", sqlite3_errmsg(self->db));
+        DBS_cancel(self);
+        return NULL;
+    }
+    
+    if (pthread_create(&self->thread, NULL, _writer, self))
+    {
+        DBS_cancel(self);
+        return NULL;
+    }
+    
+    self->started = 1;
+    
+    return self;
+}
+
+int DBS_add(DBS_t *self, uint32_t meter, uint64_t micros, uint64_t value)
+{
+    DBS_sample_t *s;
+    
+    if ((self->adding.count >= DBS_QUEUE_MAX) ||
+        (_queue_grow(&self->adding, self->adding.count + 1) < 0))
+    {
+        pthread_mutex_lock(&self->mutex);
+        self->dropped++;
+        pthread_mutex_unlock(&self->mutex);
+        return -1;
+    }
+    
+    s = &self->adding.data[self->adding.count++];
+    
+    s->micros = micros;
+    s->value = value;
+    s->meter = meter;
+    
+    return 0;
+}
+
+int DBS_flush(DBS_t *self)
+{
+    int dropped;
+    
+    if (!self->adding.count) return 0;
+    
+    pthread_mutex_lock(&self->mutex);
+    
+    dropped = _queue_move(&self->pending, &self->adding);
+    self->dropped += dropped;
+    
+    pthread_cond_signal(&self->cond);
+    pthread_mutex_unlock(&self->mutex);
+    
+    return dropped ? -1 : 0;
+}
+
+uint64_t DBS_get_written(DBS_t *self)
+{
+    uint64_t n;
+    
+    pthread_mutex_lock(&self->mutex);
+    n = self->written;
+    pthread_mutex_unlock(&self->mutex);
+    
+    return n;
+}
+
+uint64_t DBS_get_dropped(DBS_t *self)
+{
+    uint64_t n;
+    
+    pthread_mutex_lock(&self->mutex);
+    n = self->dropped;
+    pthread_mutex_unlock(&self->mutex);
+    
+    return n;
+}
+
+void DBS_cancel(DBS_t *self)
+{
+    if (!self) return;
+    
+    if (self->started)
+    {
+        DBS_flush(self);
+        
+        pthread_mutex_lock(&self->mutex);
+        self->stop = 1;
+        pthread_cond_signal(&self->cond);
+        pthread_mutex_unlock(&self->mutex);
+        
+        pthread_join(self->thread, NULL);
+    }
+    
+    sqlite3_finalize(self->insert);
+    sqlite3_close(self->db);
+    
+    pthread_cond_destroy(&self->cond);
+    pthread_mutex_destroy(&self->mutex);
+    
+    free(self->adding.data);
+    free(self->pending.data);
+    free(self->writing.data);
+    free(self);
+}
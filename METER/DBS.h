@@ -0,0 +1,67 @@
+/*
+ DBS.h
+ 2016-02-10
+ Public Domain
+ */
+
+#ifndef DBS_H
+#define DBS_H
+
+#include <stdint.h>
+
+struct _DBS_s;
+
+typedef struct _DBS_s DBS_t;
+
+/*
+
+ DBS is a database sink which keeps meter history in an SQLite file,
+ so no database server is needed.  The file is in WAL mode and all
+ writes are made on a writer thread of its own, so a slow disk never
+ holds up the caller.
+
+ Samples are kept in the table
+
+ samples (meter INTEGER, time INTEGER, value INTEGER)
+
+ with time in microseconds since the epoch and (meter, time) as the
+ primary key.  A second sample for the same meter and time replaces
+ the first.
+
+ DBS opens or creates the database at path and starts the writer.
+ It returns NULL if the database can't be opened.
+
+ DBS_add queues a sample of value for meter taken at micros.  Nothing
+ is written until the next flush.  It returns 0 if OK, otherwise -1.
+
+ DBS_flush hands the queued samples to the writer, which inserts them
+ with one prepared statement in a single transaction.  It returns at
+ once.  If the writer is still busy with earlier samples the new ones
+ wait with them, up to DBS_QUEUE_MAX samples; beyond that they are
+ dropped.  It returns 0 if OK, otherwise -1 if samples were dropped.
+
+ DBS_get_written returns the number of samples committed.
+
+ DBS_get_dropped returns the number of samples dropped, because the
+ writer fell behind or a transaction failed.
+
+ DBS_cancel writes what is queued, stops the writer and closes the
+ database.
+
+ */
+
+#define DBS_QUEUE_MAX 1000000
+
+DBS_t *DBS                (const char *path);
+
+int    DBS_add            (DBS_t *dbs, uint32_t meter, uint64_t micros, uint64_t value);
+
+int    DBS_flush          (DBS_t *dbs);
+
+uint64_t DBS_get_written  (DBS_t *dbs);
+
+uint64_t DBS_get_dropped  (DBS_t *dbs);
+
+void   DBS_cancel         (DBS_t *dbs);
+
+#endif
@@ -6,96 +6,2469 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
 
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+
+#include <linux/gpio.h>
+
+#ifdef METER_LIBPIGPIO
+#include <pigpio.h>
+#else
 #include <pigpiod_if2.h>
+#endif
 
 #include "METER.h"
 
 /* PRIVATE ---------------------------------------------------------------- */
 
+#define METER_CACHE_LINE 64
+
+#define METER_RING_MASK (METER_RING_SIZE-1)
+
+#define METER_BATCH_SIZE 1024
+
+#define METER_HIST_SUB_BITS 3
+#define METER_HIST_SUB      (1<<METER_HIST_SUB_BITS)
+#define METER_HIST_BUCKETS  ((64 - METER_HIST_SUB_BITS + 1) * METER_HIST_SUB)
+
+#define METER_SEC_USECS 1000000ULL
+#define METER_MIN_USECS 60000000ULL
+
+#define METER_BACKEND_PIGPIO   0
+#define METER_BACKEND_GPIOCHIP 1
+
+#define METER_TICK_HALF_WRAP ((int64_t)1<<31)
+
+#define METER_CLOCK_ALPHA 0.25    /* share of an offset error corrected */
+#define METER_CLOCK_BETA  0.05    /* share of a drift error corrected */
+#define METER_CLOCK_DRIFT 500e-6  /* largest believable drift */
+#define METER_CLOCK_STEP  1.0     /* seconds of error treated as a step */
+#define METER_CLOCK_STALE 2000.0  /* seconds, well inside half a wrap */
+
+#define METER_STATE_MAGIC   0x4d455452 /* METR */
+#define METER_STATE_VERSION 1
+
+/*
+ The state file holds two records.  Each update overwrites the older
+ one and the checksum is written last, so a record torn by a crash
+ or power cut is detected and the other record is used instead.
+ */
+
+typedef struct
+{
+    uint64_t seq;
+    uint64_t value;
+    uint64_t tick;          /* of the last pulse counted */
+    int64_t  sec;           /* wall clock time of the update */
+    int64_t  nsec;
+    uint32_t pad;
+    uint32_t check;
+} METER_record_t;
+
+/*
+ A count bucket belongs to the second (or minute) stamp-1.  Stamp 0
+ marks a bucket being reused, so readers can tell a count they read
+ while it was recycled.
+ */
+
+typedef struct
+{
+    _Atomic uint64_t stamp;
+    _Atomic uint64_t count;
+} METER_bucket_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    METER_record_t rec[2];
+} METER_state_t;
+
 struct _METER_s
 {
     int pi;
     int meterGPIO;
     METER_CB_t cb;
+    METER_BATCH_CB_t batch_cb;
+    METER_EVENT_CB_t event_cb;
     int cb_id;
-    int lev;
-    int oldState;
-    uint32_t meter_value;
-    uint32_t last_tick;
+    int cancel_deferred;    /* cancelled from its own callback */
+    
+    /* quadrature decoding, quadGPIO is gpioB and meterGPIO gpioA */
+    
+    int quadGPIO;
+    int mode;
+    int oldState;           /* (A<<1)|B, -1 until the first report */
+    int steps;              /* steps into the current detent */
+    
+    /* report decoding, used on the handle which owns the subscription */
+    
+    uint32_t bits;          /* gpios decoded by this subscription */
+    uint32_t levels;        /* their levels after the last report */
+    METER_t *owner;         /* handle owning the subscription */
+    METER_t *chan[32];      /* meter per gpio, self for a single meter */
+    
+    int backend;
+    
+    /* gpiochip backend */
+    
+    int chip_fd;            /* line request */
+    int chip_wake;          /* eventfd to interrupt the thread's poll */
+    pthread_t chip_thread;
+    _Atomic int chip_stop;
+    _Atomic unsigned chip_watchdog;
+    _Atomic uint32_t seq;  /* odd while value/last_tick are being updated */
+    _Atomic uint64_t meter_value;
+    _Atomic uint64_t last_tick;
+    
+    int registered;         /* on the registry, see _register */
+    METER_t *reg_next;
     unsigned glitch;
+    
+    /* software debounce, state is owned by _cb_batch */
+    
+    _Atomic uint32_t min_interval;
+    int accept_have;
+    uint64_t accept_tick;
+    _Atomic uint64_t reject_count;
+    _Atomic uint32_t reject_min;
+    _Atomic uint64_t reject_tick;
+    
+    unsigned watchdog;
+    unsigned watchdog_armed;    /* may be shorter, see _watchdog_arm */
+    int idle;
+    
+    /* reports missed by the subscription, counted on every channel */
+    
+    uint32_t notify_lost;   /* get_notify_lost after the last batch */
+    int chip_seqno_have;
+    uint32_t chip_seqno;    /* line_seqno of the last kernel event */
+    _Atomic uint64_t lost;
+    
+    /* rate estimator, state is owned by _cb */
+    
+    _Atomic int rate_gen;      /* odd while METER_set_rate_filter writes */
+    _Atomic int rate_filter_req;
+    _Atomic double rate_param_req;
+    int rate_seen_gen;
+    int rate_filter;
+    double rate_alpha;
+    int rate_ewma_have;
+    double rate_ewma;
+    uint64_t rate_window[METER_RATE_WINDOW_MAX];
+    uint64_t rate_window_sum;
+    int rate_window_len;
+    int rate_window_pos;
+    int rate_window_fill;
+    _Atomic double rate;
+    
+    /* previous pulse, for the interval fed to the rate and histogram */
+    
+    int have_prev;
+    uint64_t prev_tick;
+    
+    /* interval histogram, counts written by _cb, base owned by reader */
+    
+    _Atomic uint64_t hist[METER_HIST_BUCKETS];
+    _Atomic uint64_t hist_max;
+    uint64_t hist_base[METER_HIST_BUCKETS];
+    
+    /* pulses per second and per minute, written by _cb */
+    
+    METER_bucket_t sec[METER_SECONDS];
+    METER_bucket_t min[METER_MINUTES];
+    
+    /* tick to wall clock correlation, see METER_clock_update */
+    
+    pthread_mutex_t clock_mutex;
+    int clock_have;
+    uint32_t clock_tick;    /* reference tick */
+    double clock_wall;      /* its CLOCK_REALTIME in seconds */
+    double clock_drift;     /* fractional rate error of the tick */
+    uint32_t clock_rtt;     /* shortest recent sampling time, micros */
+    
+    /* tick and host time of the last batch, for the current tick */
+    
+    _Atomic uint64_t now_tick;
+    _Atomic uint64_t now_host;
+    
+    /* readiness eventfd, written by _flush */
+    
+    _Atomic int notify_fd;
+    _Atomic uint32_t notify_count;
+    _Atomic uint32_t notify_usecs;
+    uint64_t notify_pending;  /* pulses not yet signalled */
+    uint64_t notify_first;    /* tick of the oldest of them */
+    
+    /* mmap'd state file, records are written inside the seqlock */
+    
+    _Atomic(METER_state_t *) state;
+    int state_fd;
+    uint64_t state_seq;
+    uint64_t state_base;    /* position the count since start is added to */
+    int state_restored;
+    uint64_t state_tick;    /* of the record restored */
+    struct timespec state_time;
+    
+    /* wrap-extended tick, owned by _cb_batch */
+    
+    uint64_t tick_ext;
+    uint64_t tick_host;
+    
+    int batch_count;
+    int64_t batch_delta;
+    int batch_published;    /* batch already seen by readers */
+    uint64_t batch_value;   /* position after the batch, once published */
+    int8_t batch_dir[METER_BATCH_SIZE];
+    uint64_t batch[METER_BATCH_SIZE];
+    
+    /* pulse tick ring, written by _cb only and read by METER_drain only */
+    
+    _Alignas(METER_CACHE_LINE) _Atomic uint64_t ring_head;
+    _Alignas(METER_CACHE_LINE) uint64_t ring_tail;
+    uint64_t ring_lost;
+    _Alignas(METER_CACHE_LINE) _Atomic uint64_t ring[METER_RING_SIZE];
 };
 
+/*
+ Every meter is also on a process wide registry so all of them can be
+ read at one instant.  The registry word counts the writers inside
+ _write_begin/_write_end in its low half and the completed writes in
+ its high half.  Writers just add to it, so they never wait on each
+ other across meters; a registry reader retries unless no writer was
+ active and nothing completed while it copied.
+ */
+
+#define METER_REG_WRITER 1ULL
+#define METER_REG_GEN    (1ULL<<32)
+#define METER_REG_ACTIVE (METER_REG_GEN-1)
+
+static _Atomic uint64_t gRegSeq;
 
-static void _cb(
-                int pi, unsigned gpio, unsigned level, uint32_t tick, void *user)
+static pthread_mutex_t gRegMutex = PTHREAD_MUTEX_INITIALIZER;
+static METER_t *gRegFirst = NULL;
+static METER_t *gRegLast  = NULL;
+
+static void _reg_begin(void)
 {
-    METER_t *self=user;
+    atomic_fetch_add_explicit(&gRegSeq, METER_REG_WRITER, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void _reg_end(void)
+{
+    atomic_fetch_add_explicit(&gRegSeq, METER_REG_GEN - METER_REG_WRITER,
+                              memory_order_release);
+}
+
+static void _register(METER_t *self)
+{
+    pthread_mutex_lock(&gRegMutex);
+    
+    self->reg_next = NULL;
+    
+    if (gRegLast) gRegLast->reg_next = self;
+    else          gRegFirst = self;
+    
+    gRegLast = self;
+    self->registered = 1;
+    
+    pthread_mutex_unlock(&gRegMutex);
+}
+
+static void _unregister(METER_t *self)
+{
+    METER_t *p, *prev;
+    
+    if (!self->registered) return;
+    
+    pthread_mutex_lock(&gRegMutex);
+    
+    prev = NULL;
     
-    if (level != PI_TIMEOUT)
+    for (p=gRegFirst; p && (p != self); p=p->reg_next) prev = p;
+    
+    if (p)
     {
-        self->meter_value++;
-        (self->cb)(self->meter_value,tick);
+        if (prev) prev->reg_next = self->reg_next;
+        else      gRegFirst = self->reg_next;
+        
+        if (gRegLast == self) gRegLast = prev;
     }
+    
+    self->registered = 0;
+    
+    pthread_mutex_unlock(&gRegMutex);
 }
 
-/* PUBLIC ----------------------------------------------------------------- */
+/*
+ Writers (the pulse callback and METER_set_position) bracket their
+ updates with _write_begin/_write_end.  The sequence word doubles as
+ the writer lock, so readers only ever load it.
+ */
 
-METER_t *METER(int pi, int meterGPIO, uint32_t start_meter_value, unsigned glitch, METER_CB_t cb_func)
+static uint32_t _write_begin(METER_t *self)
 {
-    METER_t *self;
+    uint32_t seq;
     
-    self = malloc(sizeof(METER_t));
+    seq = atomic_load_explicit(&self->seq, memory_order_relaxed);
     
-    if (!self) return NULL;
+    while ((seq & 1) ||
+           !atomic_compare_exchange_weak_explicit(
+              &self->seq, &seq, seq+1,
+              memory_order_relaxed, memory_order_relaxed))
+    {
+        seq = atomic_load_explicit(&self->seq, memory_order_relaxed);
+    }
     
-    self->pi = pi;
-    self->meterGPIO = meterGPIO;
-    self->meter_value = start_meter_value;
-    self->cb = cb_func;
-    self->lev=0;
-    self->last_tick=0;
-    self->glitch=glitch;
+    _reg_begin();
+    
+    return seq;
+}
+
+static void _write_end(METER_t *self, uint32_t seq)
+{
+    atomic_store_explicit(&self->seq, seq+2, memory_order_release);
+    
+    _reg_end();
+}
+
+static uint32_t _record_check(METER_record_t *rec)
+{
+    const uint8_t *p;
+    uint32_t hash;
+    int i;
     
-    set_mode(pi, meterGPIO, PI_INPUT);
+    /* FNV-1a over everything but the check word */
     
-    /* pull up is needed as encoder common is grounded */
+    p = (const uint8_t *)rec;
+    hash = 2166136261u;
+    
+    for (i=0; i<offsetof(METER_record_t, check); i++)
+    {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    
+    return hash;
+}
+
+/* must be called between _write_begin and _write_end */
+
+static void _state_write(METER_t *self, uint64_t value, uint64_t tick)
+{
+    METER_state_t *state;
+    METER_record_t *rec;
+    struct timespec ts;
     
-    set_pull_up_down(pi, meterGPIO, PI_PUD_OFF);
+    state = atomic_load_explicit(&self->state, memory_order_acquire);
     
-    set_glitch_filter(pi, meterGPIO, self->glitch);
+    if (!state) return;
     
-    /* monitor encoder level changes */
+    rec = &state->rec[(self->state_seq+1) & 1];
     
-    self->cb_id = callback_ex(pi, meterGPIO, RISING_EDGE, _cb, self);
+    rec->check = 0;
+    atomic_signal_fence(memory_order_seq_cst);
     
-    return self;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    
+    rec->seq = ++self->state_seq;
+    rec->value = value;
+    rec->tick = tick;
+    rec->sec = ts.tv_sec;
+    rec->nsec = ts.tv_nsec;
+    rec->pad = 0;
+    
+    atomic_signal_fence(memory_order_seq_cst);
+    rec->check = _record_check(rec);
 }
 
-void METER_cancel(METER_t *self)
+
+/*
+ The requested filter and parameter are a pair published under
+ rate_gen like a seqlock.  A pair caught mid-update is ignored and
+ picked up at the next pulse.
+ */
+
+static int _rate_reset(METER_t *self, int gen)
+{
+    double param;
+    int filter;
+    
+    if (gen & 1) return -1;
+    
+    filter = atomic_load_explicit(&self->rate_filter_req, memory_order_relaxed);
+    param = atomic_load_explicit(&self->rate_param_req, memory_order_relaxed);
+    
+    atomic_thread_fence(memory_order_acquire);
+    
+    if (atomic_load_explicit(&self->rate_gen, memory_order_relaxed) != gen)
+        return -1;
+    
+    self->rate_filter = filter;
+    
+    if (self->rate_filter == METER_RATE_WINDOW)
+    {
+        self->rate_window_len = param;
+        if (self->rate_window_len < 1) self->rate_window_len = 1;
+        if (self->rate_window_len > METER_RATE_WINDOW_MAX)
+            self->rate_window_len = METER_RATE_WINDOW_MAX;
+    }
+    else
+    {
+        self->rate_alpha = param;
+        if ((self->rate_alpha <= 0.0) || (self->rate_alpha > 1.0))
+            self->rate_alpha = METER_RATE_DEFAULT_ALPHA;
+    }
+    
+    self->rate_ewma_have = 0;
+    self->rate_window_sum = 0;
+    self->rate_window_pos = 0;
+    self->rate_window_fill = 0;
+    
+    return 0;
+}
+
+/*
+ The rate is estimated from the interval between consecutive
+ pulses, smoothed either by an EWMA or by the mean of the last
+ rate_window_len intervals.  Both are O(1) per pulse.
+ */
+
+static void _rate_update(METER_t *self, uint64_t interval)
 {
-    if (self)
+    double mean;
+    int gen;
+    
+    gen = atomic_load_explicit(&self->rate_gen, memory_order_acquire);
+    
+    if ((gen != self->rate_seen_gen) && !_rate_reset(self, gen))
+        self->rate_seen_gen = gen;
+    
+    if (self->rate_filter == METER_RATE_WINDOW)
     {
+        if (self->rate_window_fill == self->rate_window_len)
+            self->rate_window_sum -= self->rate_window[self->rate_window_pos];
+        else
+            self->rate_window_fill++;
         
-        if (self->cb_id >= 0)
+        self->rate_window[self->rate_window_pos] = interval;
+        self->rate_window_sum += interval;
+        
+        if (++self->rate_window_pos == self->rate_window_len)
+            self->rate_window_pos = 0;
+        
+        mean = (double)self->rate_window_sum / self->rate_window_fill;
+    }
+    else
+    {
+        if (!self->rate_ewma_have)
         {
-            callback_cancel(self->cb_id);
-            self->cb_id = -1;
+            self->rate_ewma = interval;
+            self->rate_ewma_have = 1;
         }
-        set_glitch_filter(self->pi, self->meterGPIO, 0);
+        else self->rate_ewma += self->rate_alpha * (interval - self->rate_ewma);
+        
+        mean = self->rate_ewma;
+    }
+    
+    if (mean > 0.0)
+        atomic_store_explicit(&self->rate, 1000000.0 / mean, memory_order_relaxed);
+}
+
+/*
+ The interval histogram has METER_HIST_SUB linear buckets per power
+ of two (and one per microsecond below METER_HIST_SUB), so any
+ recorded interval is known to within 1/METER_HIST_SUB.  Finding the
+ bucket is a count-leading-zeros and two shifts.
+ */
+
+static int _hist_bucket(uint64_t v)
+{
+    int e;
+    
+    if (v < METER_HIST_SUB) return v;
+    
+    e = 63 - __builtin_clzll(v);
+    
+    return (e - METER_HIST_SUB_BITS + 1) * METER_HIST_SUB +
+           ((v >> (e - METER_HIST_SUB_BITS)) & (METER_HIST_SUB-1));
+}
+
+static uint64_t _hist_upper(int b)
+{
+    int e, sub;
+    
+    if (b < METER_HIST_SUB) return b;
+    
+    e = b / METER_HIST_SUB + METER_HIST_SUB_BITS - 1;
+    sub = b % METER_HIST_SUB;
+    
+    return ((uint64_t)(METER_HIST_SUB + sub + 1) << (e - METER_HIST_SUB_BITS)) - 1;
+}
+
+static void _hist_update(METER_t *self, uint64_t interval)
+{
+    _Atomic uint64_t *h;
+    
+    h = &self->hist[_hist_bucket(interval)];
+    
+    atomic_store_explicit(h,
+       atomic_load_explicit(h, memory_order_relaxed) + 1, memory_order_relaxed);
+    
+    if (interval > atomic_load_explicit(&self->hist_max, memory_order_relaxed))
+        atomic_store_explicit(&self->hist_max, interval, memory_order_relaxed);
+}
+
+/*
+ The count buckets form rings indexed by second (or minute) modulo
+ their size.  A bucket is reset lazily by the first pulse of a new
+ period to land in it, so nothing needs to run while the meter is
+ quiet; stale buckets are recognised by their stamp.  Ticks are
+ already 64 bit here, so the periods never wrap.
+ */
+
+static void _bucket_add(METER_bucket_t *ring, int size, uint64_t period)
+{
+    METER_bucket_t *b;
+    
+    b = &ring[period % size];
+    
+    if (atomic_load_explicit(&b->stamp, memory_order_relaxed) != period+1)
+    {
+        atomic_store_explicit(&b->stamp, 0, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        atomic_store_explicit(&b->count, 0, memory_order_relaxed);
+        atomic_store_explicit(&b->stamp, period+1, memory_order_release);
+    }
+    
+    atomic_store_explicit(&b->count,
+       atomic_load_explicit(&b->count, memory_order_relaxed) + 1,
+       memory_order_relaxed);
+}
+
+static uint64_t _bucket_get(METER_bucket_t *ring, int size, uint64_t period)
+{
+    METER_bucket_t *b;
+    uint64_t stamp, count;
+    
+    b = &ring[period % size];
+    
+    stamp = atomic_load_explicit(&b->stamp, memory_order_acquire);
+    count = atomic_load_explicit(&b->count, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    
+    if ((stamp != period+1) ||
+        (atomic_load_explicit(&b->stamp, memory_order_relaxed) != stamp))
+        return 0;
+    
+    return count;
+}
+
+/* sum of the buckets for periods first..last, those retained */
+
+static uint64_t _bucket_sum(METER_bucket_t *ring, int size, uint64_t first, uint64_t last)
+{
+    uint64_t p, sum;
+    
+    if (last >= (uint64_t)size && first <= last-size) first = last-size+1;
+    
+    sum = 0;
+    
+    for (p=first; p<=last; p++) sum += _bucket_get(ring, size, p);
+    
+    return sum;
+}
+
+/*
+ Pulses are signalled on the eventfd once enough have collected or
+ the oldest has waited long enough.  The eventfd counter adds up the
+ pulses until the application reads it.
+ */
+
+static void _notify(METER_t *self, uint64_t tick, int force)
+{
+    uint32_t count, usecs;
+    uint64_t n;
+    int fd;
+    
+    fd = atomic_load_explicit(&self->notify_fd, memory_order_acquire);
+    
+    if ((fd < 0) || !self->notify_pending) return;
+    
+    if (!force)
+    {
+        count = atomic_load_explicit(&self->notify_count, memory_order_relaxed);
+        usecs = atomic_load_explicit(&self->notify_usecs, memory_order_relaxed);
+        
+        if ((count || usecs) &&
+            !(count && (self->notify_pending >= count)) &&
+            !(usecs && ((tick - self->notify_first) >= usecs))) return;
+    }
+    
+    n = self->notify_pending;
+    self->notify_pending = 0;
+    
+    /* only fails if the reader has let the counter fill up */
+    
+    if (write(fd, &n, sizeof(n)) < 0) return;
+}
+
+/*
+ _cb handles one pulse.  The pulses of a report batch are collected
+ and published to readers once, by _publish, then handed to the
+ callbacks by _flush.
+ */
+
+static void _cb(METER_t *self, uint64_t tick, int dir)
+{
+    uint64_t head, interval;
+    
+    head = atomic_load_explicit(&self->ring_head, memory_order_relaxed);
+    atomic_store_explicit(&self->ring[head & METER_RING_MASK], tick,
+                          memory_order_relaxed);
+    atomic_store_explicit(&self->ring_head, head+1, memory_order_release);
+    
+    if (self->have_prev)
+    {
+        interval = tick - self->prev_tick;
+        
+        _rate_update(self, interval);
+        _hist_update(self, interval);
+    }
+    
+    self->have_prev = 1;
+    self->prev_tick = tick;
+    
+    _bucket_add(self->sec, METER_SECONDS, tick / METER_SEC_USECS);
+    _bucket_add(self->min, METER_MINUTES, tick / METER_MIN_USECS);
+    
+    self->batch_dir[self->batch_count] = dir;
+    self->batch[self->batch_count++] = tick;
+    self->batch_delta += dir;
+}
+
+static void _publish(METER_t *self)
+{
+    uint64_t value;
+    uint32_t seq;
+    int count;
+    
+    count = self->batch_count;
+    
+    if (!count || self->batch_published) return;
+    
+    seq = _write_begin(self);
+    value = atomic_load_explicit(&self->meter_value, memory_order_relaxed) +
+            self->batch_delta;
+    atomic_store_explicit(&self->meter_value, value, memory_order_relaxed);
+    atomic_store_explicit(&self->last_tick, self->batch[count-1],
+                          memory_order_relaxed);
+    _state_write(self, value, self->batch[count-1]);
+    _write_end(self, seq);
+    
+    self->batch_value = value;
+    self->batch_published = 1;
+}
+
+static void _flush(METER_t *self)
+{
+    uint64_t value, v;
+    int64_t delta;
+    int i, count;
+    
+    _publish(self);
+    
+    count = self->batch_count;
+    
+    if (!count) return;
+    
+    value = self->batch_value;
+    delta = self->batch_delta;
+    
+    self->batch_count = 0;
+    self->batch_delta = 0;
+    self->batch_published = 0;
+    
+    if (self->cb)
+    {
+        v = value - delta;
         
-        free(self);
+        for (i=0; i<count; i++)
+        {
+            v += self->batch_dir[i];
+            (self->cb)(v, self->batch[i]);
+        }
     }
+    
+    if (self->batch_cb) (self->batch_cb)(value, self->batch, count);
+    
+    /* pulses are only owed to a reader once the eventfd exists */
+    
+    if (atomic_load_explicit(&self->notify_fd, memory_order_relaxed) < 0) return;
+    
+    if (!self->notify_pending) self->notify_first = self->batch[0];
+    
+    self->notify_pending += count;
+    
+    _notify(self, self->batch[count-1], 0);
 }
 
-uint32_t METER_get_position(METER_t *self)
+static uint64_t _host_micros(void)
 {
-    return self->meter_value;
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-void METER_set_position(METER_t *self, uint32_t value)
+/*
+ The 32 bit pigpio tick wraps every 2^32 microseconds.  Each report
+ tick is widened by adding its (modulo 2^32) distance from the
+ previous one.  That is only ambiguous when more than a whole wrap
+ passes between reports, so the host clock is consulted once per
+ batch to count any wraps missed while the gpio was quiet.
+ */
+
+static void _extend_gap(METER_t *self, uint32_t tick)
 {
-    self->meter_value=value;
+    uint64_t now;
+    int64_t elapsed, wraps;
+    uint32_t delta;
+    
+    now = _host_micros();
+    
+    elapsed = now - self->tick_host;
+    
+    if (self->tick_host && (elapsed > METER_TICK_HALF_WRAP))
+    {
+        delta = tick - (uint32_t)self->tick_ext;
+        
+        wraps = (elapsed - delta + METER_TICK_HALF_WRAP) >> 32;
+        
+        if (wraps > 0) self->tick_ext += (uint64_t)wraps << 32;
+    }
+    
+    self->tick_host = now;
+}
+
+static uint64_t _extend(METER_t *self, uint32_t tick)
+{
+    self->tick_ext += (uint32_t)(tick - (uint32_t)self->tick_ext);
+    
+    return self->tick_ext;
+}
+
+/*
+ The current tick is the tick of the last batch plus the host time
+ since it arrived.  A gpiochip meter's ticks are the host clock.
+ */
+
+static uint64_t _now(METER_t *self)
+{
+    uint64_t host;
+    
+    if (self->backend == METER_BACKEND_GPIOCHIP) return _host_micros();
+    
+    self = self->owner;
+    
+    host = atomic_load_explicit(&self->now_host, memory_order_acquire);
+    
+    if (!host) return atomic_load_explicit(&self->now_tick, memory_order_relaxed);
+    
+    return atomic_load_explicit(&self->now_tick, memory_order_relaxed) +
+           (_host_micros() - host);
+}
+
+/*
+ An edge closer than min_interval to the previous accepted edge is a
+ bounce.  It is dropped and only shows up in the debounce statistics.
+ */
+
+static int _accept(METER_t *self, uint64_t tick)
+{
+    uint64_t interval;
+    uint32_t min;
+    
+    interval = tick - self->accept_tick;
+    
+    if (self->accept_have)
+    {
+        min = atomic_load_explicit(&self->min_interval, memory_order_relaxed);
+        
+        if (interval < min)
+        {
+            atomic_store_explicit(&self->reject_count,
+               atomic_load_explicit(&self->reject_count, memory_order_relaxed) + 1,
+               memory_order_relaxed);
+            
+            if (interval < atomic_load_explicit(&self->reject_min, memory_order_relaxed))
+                atomic_store_explicit(&self->reject_min, interval, memory_order_relaxed);
+            
+            atomic_store_explicit(&self->reject_tick, tick, memory_order_relaxed);
+            
+            return 0;
+        }
+    }
+    
+    self->accept_have = 1;
+    self->accept_tick = tick;
+    
+    return 1;
+}
+
+/*
+ A watchdog timeout means no level change for watchdog ms.  Whatever
+ the filter says, the rate can be no higher than one pulse in the
+ time since the last one, so the estimate decays toward zero while
+ the meter is stopped.  The last pulse is the last one counted by
+ _cb, which quadrature and single gpio meters share.
+ */
+
+static void _timeout(METER_t *self, uint64_t tick)
+{
+    uint64_t elapsed;
+    double bound;
+    
+    _flush(self);
+    
+    _notify(self, tick, 1);
+    
+    if (self->have_prev)
+    {
+        elapsed = tick - self->prev_tick;
+        
+        if (elapsed)
+        {
+            bound = 1000000.0 / elapsed;
+            
+            if (atomic_load_explicit(&self->rate, memory_order_relaxed) > bound)
+                atomic_store_explicit(&self->rate, bound, memory_order_relaxed);
+        }
+    }
+    
+    /* the watchdog may be armed shorter than asked, for METER_set_notify */
+    
+    if (!self->idle && self->watchdog &&
+        ((tick - self->prev_tick) >= (uint64_t)self->watchdog * 1000))
+    {
+        self->idle = 1;
+        
+        if (self->event_cb)
+            (self->event_cb)(METER_EVENT_IDLE,
+               atomic_load_explicit(&self->meter_value, memory_order_relaxed),
+               tick);
+    }
+}
+
+/*
+ Reports which never arrived may have held pulses for any of the
+ subscription's gpios, so every channel is told.
+ */
+
+static void _missed_one(METER_t *self, uint64_t count, uint64_t tick)
+{
+    atomic_fetch_add_explicit(&self->lost, count, memory_order_relaxed);
+    
+    if (self->event_cb)
+        (self->event_cb)(METER_EVENT_LOST,
+           atomic_load_explicit(&self->meter_value, memory_order_relaxed),
+           tick);
+}
+
+static void _missed(METER_t *self, uint64_t count, uint64_t tick)
+{
+    uint32_t bits;
+    int g;
+    
+    if (self->quadGPIO >= 0)
+    {
+        _missed_one(self, count, tick);
+        return;
+    }
+    
+    bits = self->bits;
+    
+    while (bits)
+    {
+        g = __builtin_ctz(bits);
+        bits &= bits-1;
+        
+        _missed_one(self->chan[g], count, tick);
+    }
+}
+
+/*
+ Reports (or, in process, samples) are decoded in batches:
+ _decode_begin, _decode for each report, then _decode_end to
+ publish what the batch counted.
+ */
+
+static void _decode_begin(METER_t *self, uint32_t tick)
+{
+    _extend_gap(self, tick);
+}
+
+static void _rising(METER_t *self, uint64_t tick, uint32_t rising)
+{
+    METER_t *m;
+    int g;
+    
+    while (rising)
+    {
+        g = __builtin_ctz(rising);
+        rising &= rising-1;
+        
+        m = self->chan[g];
+        
+        if (_accept(m, tick))
+        {
+            m->idle = 0;
+            
+            _cb(m, tick, 1);
+            
+            if (m->batch_count == METER_BATCH_SIZE) _flush(m);
+        }
+    }
+}
+
+/*
+ Quadrature state transitions, indexed by (old<<2)|new where a state
+ is (A<<1)|B.  A leading B counts up.  Transitions where both gpios
+ changed at once are invalid and ignored.
+ */
+
+static const int8_t _quad_step[16] =
+{
+    0, -1,  1,  0,
+    1,  0,  0, -1,
+   -1,  0,  0,  1,
+    0,  1, -1,  0,
+};
+
+static void _quad(METER_t *self, uint64_t tick, uint32_t level)
+{
+    int state, step;
+    
+    state = (((level >> self->meterGPIO) & 1) << 1) |
+             ((level >> self->quadGPIO) & 1);
+    
+    if (self->oldState < 0) step = 0;
+    else step = _quad_step[(self->oldState << 2) | state];
+    
+    self->oldState = state;
+    
+    if (!step) return;
+    
+    /*
+     min_interval is not applied: dropping one step of a bounce would
+     count its reverse alone, whereas the table already cancels them.
+     */
+    
+    if (self->mode == METER_MODE_DETENT)
+    {
+        /* a detent is four steps in the same direction */
+        
+        self->steps += step;
+        
+        if ((self->steps != 4) && (self->steps != -4)) return;
+        
+        self->steps = 0;
+    }
+    
+    self->idle = 0;
+    
+    _cb(self, tick, step);
+    
+    if (self->batch_count == METER_BATCH_SIZE) _flush(self);
+}
+
+static void _decode(METER_t *self, uint32_t tick32, uint32_t level, unsigned flags)
+{
+    uint64_t tick;
+    uint32_t rising;
+    int g;
+    
+    tick = _extend(self, tick32);
+    
+    /* watchdog and keep alive reports carry no level change */
+    
+    if (flags)
+    {
+        g = flags & 31;
+        
+        if ((flags & PI_NTFY_FLAGS_WDOG) && (self->bits & (1<<g)))
+            _timeout(self->chan[g], tick);
+        
+        return;
+    }
+    
+    if (self->quadGPIO >= 0)
+    {
+        _quad(self, tick, level);
+        return;
+    }
+    
+    /* one pass over the level word finds every channel's rising edge */
+    
+    rising = level & ~self->levels & self->bits;
+    
+    self->levels = level;
+    
+    _rising(self, tick, rising);
+}
+
+static void _decode_end(METER_t *self)
+{
+    uint32_t bits;
+    
+    /* the channels change together for METER_snapshot_all ... */
+    
+    _reg_begin();
+    
+    for (bits=self->bits; bits; bits&=bits-1)
+        _publish(self->chan[__builtin_ctz(bits)]);
+    
+    _reg_end();
+    
+    /* ... which the callbacks may therefore call */
+    
+    for (bits=self->bits; bits; bits&=bits-1)
+        _flush(self->chan[__builtin_ctz(bits)]);
+    
+    atomic_store_explicit(&self->now_tick, self->tick_ext, memory_order_relaxed);
+    atomic_store_explicit(&self->now_host, self->tick_host, memory_order_release);
+}
+
+/* BACKEND ---------------------------------------------------------------- */
+
+#ifdef METER_LIBPIGPIO
+
+/*
+ In process the meters are fed from libpigpio's sample batches, the
+ equivalent of a pigpiod report batch.  There is one samples
+ function per process, so it serves every subscribed handle.
+ Watchdog timeouts only reach alert functions, which are therefore
+ registered just for gpios with a watchdog.
+
+ The callbacks run on pigpio's alert thread.  Under gLocalMutex they
+ mark the handles they are about to use as held, then decode without
+ the lock, so the user's callbacks may call anything.  Once
+ _pig_unsubscribe has cleared a slot it waits until its handle is no
+ longer held, after which it may be freed.  A handle cancelled from
+ one of its own callbacks can't wait for itself; it is finished once
+ the alert thread is done with it.
+ */
+
+#define METER_MAX_LOCAL 32
+
+static METER_t *_Atomic gLocal[METER_MAX_LOCAL];
+
+static pthread_mutex_t gLocalMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gLocalCond = PTHREAD_COND_INITIALIZER;
+
+static uint32_t gLocalHeld;     /* slots in use by the alert thread */
+static pthread_t gLocalThread;
+
+static int _local_hold(METER_t **held, METER_t *only)
+{
+    METER_t *self;
+    int h, n;
+    
+    n = 0;
+    
+    pthread_mutex_lock(&gLocalMutex);
+    
+    for (h=0; h<METER_MAX_LOCAL; h++)
+    {
+        self = atomic_load_explicit(&gLocal[h], memory_order_acquire);
+        
+        if (!self || (only && (self != only))) continue;
+        
+        held[n++] = self;
+        gLocalHeld |= 1u<<h;
+    }
+    
+    gLocalThread = pthread_self();
+    
+    pthread_mutex_unlock(&gLocalMutex);
+    
+    return n;
+}
+
+static void _local_release(METER_t **held, int n)
+{
+    int i, deferred;
+    
+    deferred = 0;
+    
+    pthread_mutex_lock(&gLocalMutex);
+    
+    for (i=0; i<n; i++)
+        if (held[i]->cancel_deferred) held[deferred++] = held[i];
+    
+    gLocalHeld = 0;
+    pthread_cond_broadcast(&gLocalCond);
+    
+    pthread_mutex_unlock(&gLocalMutex);
+    
+    for (i=0; i<deferred; i++)
+    {
+        held[i]->cancel_deferred = 0;
+        METER_cancel(held[i]);
+    }
+}
+
+static void _samples(const gpioSample_t *samples, int numSamples, void *user)
+{
+    METER_t *held[METER_MAX_LOCAL];
+    METER_t *self;
+    int i, h, n;
+    
+    if (numSamples <= 0) return;
+    
+    n = _local_hold(held, NULL);
+    
+    for (h=0; h<n; h++)
+    {
+        self = held[h];
+        
+        if (self->cancel_deferred) continue;
+        
+        _decode_begin(self, samples[0].tick);
+        
+        for (i=0; i<numSamples; i++)
+            _decode(self, samples[i].tick, samples[i].level, 0);
+        
+        _decode_end(self);
+    }
+    
+    _local_release(held, n);
+}
+
+static void _alert(int gpio, int level, uint32_t tick, void *user)
+{
+    METER_t *held[METER_MAX_LOCAL];
+    METER_t *self;
+    int n;
+    
+    if (level != PI_TIMEOUT) return;
+    
+    /* user is only dereferenced while it is still subscribed */
+    
+    n = _local_hold(held, user);
+    
+    if (n)
+    {
+        self = held[0];
+        
+        _decode_begin(self, tick);
+        _decode(self, tick, self->levels, PI_NTFY_FLAGS_WDOG | gpio);
+        _decode_end(self);
+    }
+    
+    _local_release(held, n);
+}
+
+static int _samples_bits(void)
+{
+    METER_t *self;
+    uint32_t bits;
+    int h;
+    
+    bits = 0;
+    
+    for (h=0; h<METER_MAX_LOCAL; h++)
+    {
+        self = atomic_load(&gLocal[h]);
+        if (self) bits |= self->bits;
+    }
+    
+    if (bits) return gpioSetGetSamplesFuncEx(_samples, bits, NULL);
+    else      return gpioSetGetSamplesFuncEx(NULL, 0, NULL);
+}
+
+static void _pig_setup(METER_t *self)
+{
+    gpioSetMode(self->meterGPIO, PI_INPUT);
+    
+    /* pull up is needed as encoder common is grounded */
+    
+    gpioSetPullUpDown(self->meterGPIO, PI_PUD_OFF);
+    
+    if (self->quadGPIO >= 0)
+    {
+        gpioSetMode(self->quadGPIO, PI_INPUT);
+        gpioSetPullUpDown(self->quadGPIO, PI_PUD_OFF);
+    }
+}
+
+static int _pig_glitch(METER_t *self, unsigned glitch)
+{
+    if (self->quadGPIO >= 0) gpioGlitchFilter(self->quadGPIO, glitch);
+    
+    return gpioGlitchFilter(self->meterGPIO, glitch);
+}
+
+static uint32_t _pig_tick(METER_t *self)
+{
+    return gpioTick();
+}
+
+static int _pig_watchdog(METER_t *self, unsigned timeout)
+{
+    int err;
+    
+    if (timeout) err = gpioSetAlertFuncEx(self->meterGPIO, _alert, self->owner);
+    else         err = gpioSetAlertFuncEx(self->meterGPIO, NULL, NULL);
+    
+    if (err < 0) return err;
+    
+    return gpioSetWatchdog(self->meterGPIO, timeout);
+}
+
+static void _pig_unsubscribe(METER_t *self)
+{
+    uint32_t bit;
+    
+    /* waits for a callback in flight to finish with the handle */
+    
+    bit = 1u<<self->cb_id;
+    
+    pthread_mutex_lock(&gLocalMutex);
+    
+    atomic_store(&gLocal[self->cb_id], NULL);
+    
+    if ((gLocalHeld & bit) && pthread_equal(gLocalThread, pthread_self()))
+        self->cancel_deferred = 1;
+    else
+        while (gLocalHeld & bit) pthread_cond_wait(&gLocalCond, &gLocalMutex);
+    
+    pthread_mutex_unlock(&gLocalMutex);
+    
+    self->cb_id = -1;
+    _samples_bits();
+}
+
+static int _pig_subscribe(METER_t *self)
+{
+    int h;
+    
+    self->levels = gpioRead_Bits_0_31();
+    
+    /* a slot still held belongs to a handle not yet finished with */
+    
+    pthread_mutex_lock(&gLocalMutex);
+    
+    for (h=0; h<METER_MAX_LOCAL; h++)
+    {
+        if (!atomic_load(&gLocal[h]) && !(gLocalHeld & (1u<<h)))
+        {
+            atomic_store(&gLocal[h], self);
+            break;
+        }
+    }
+    
+    pthread_mutex_unlock(&gLocalMutex);
+    
+    if (h == METER_MAX_LOCAL) return PI_NO_HANDLE;
+    
+    self->cb_id = h;
+    
+    if (_samples_bits() < 0)
+    {
+        _pig_unsubscribe(self);
+        return PI_NO_HANDLE;
+    }
+    
+    return h;
+}
+
+#else
+
+static void _cb_batch(int pi, gpioReport_t *r, unsigned count, void *user)
+{
+    METER_t *self=user;
+    uint32_t lost;
+    unsigned i;
+    
+    if (!count) return;
+    
+    _decode_begin(self, r[0].tick);
+    
+    for (i=0; i<count; i++) _decode(self, r[i].tick, r[i].level, r[i].flags);
+    
+    _decode_end(self);
+    
+    /* pigpiod_if2 has counted any seqno gap before calling us */
+    
+    lost = get_notify_lost(pi);
+    
+    if (lost != self->notify_lost)
+    {
+        _missed(self, (uint32_t)(lost - self->notify_lost), self->tick_ext);
+        self->notify_lost = lost;
+    }
+}
+
+static void _pig_setup(METER_t *self)
+{
+    set_mode(self->pi, self->meterGPIO, PI_INPUT);
+    
+    /* pull up is needed as encoder common is grounded */
+    
+    set_pull_up_down(self->pi, self->meterGPIO, PI_PUD_OFF);
+    
+    if (self->quadGPIO >= 0)
+    {
+        set_mode(self->pi, self->quadGPIO, PI_INPUT);
+        set_pull_up_down(self->pi, self->quadGPIO, PI_PUD_OFF);
+    }
+}
+
+static int _pig_glitch(METER_t *self, unsigned glitch)
+{
+    if (self->quadGPIO >= 0)
+        set_glitch_filter(self->pi, self->quadGPIO, glitch);
+    
+    return set_glitch_filter(self->pi, self->meterGPIO, glitch);
+}
+
+static int _pig_watchdog(METER_t *self, unsigned timeout)
+{
+    return set_watchdog(self->pi, self->meterGPIO, timeout);
+}
+
+static uint32_t _pig_tick(METER_t *self)
+{
+    return get_current_tick(self->pi);
+}
+
+static int _pig_subscribe(METER_t *self)
+{
+    /* monitor level changes, a report batch at a time */
+    
+    self->levels = read_bank_1(self->pi);
+    
+    self->notify_lost = get_notify_lost(self->pi);
+    
+    self->cb_id = callback_batch(self->pi, self->bits, _cb_batch, self);
+    
+    return self->cb_id;
+}
+
+static void _pig_unsubscribe(METER_t *self)
+{
+    callback_cancel(self->cb_id);
+    self->cb_id = -1;
+}
+
+#endif
+
+/*
+ A gpiochip meter requests its line from the kernel GPIO character
+ device with rising edge events, so nothing runs until an edge
+ arrives.  A thread per meter sleeps in poll, then reads whatever
+ events the kernel has queued in one go.  The kernel timestamps
+ (CLOCK_MONOTONIC) become the meter's 64 bit ticks directly.
+ */
+
+#define METER_CHIP_EVENTS 64
+
+/* the kernel debounce takes the place of the glitch filter */
+
+static void _chip_config(struct gpio_v2_line_config *config, unsigned glitch)
+{
+    memset(config, 0, sizeof(*config));
+    
+    config->flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING;
+    
+    if (glitch)
+    {
+        config->num_attrs = 1;
+        config->attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+        config->attrs[0].attr.debounce_period_us = glitch;
+        config->attrs[0].mask = 1;
+    }
+}
+
+static void *_chip_thread(void *user)
+{
+    METER_t *self=user;
+    struct gpio_v2_line_event ev[METER_CHIP_EVENTS];
+    struct pollfd fds[2];
+    struct timespec ts;
+    uint64_t tick, wake;
+    uint32_t gap;
+    unsigned watchdog;
+    int n, i;
+    
+    fds[0].fd = self->chip_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = self->chip_wake;
+    fds[1].events = POLLIN;
+    
+    while (!atomic_load(&self->chip_stop))
+    {
+        watchdog = atomic_load(&self->chip_watchdog);
+        
+        n = poll(fds, 2, watchdog ? (int)watchdog : -1);
+        
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+        
+        if (fds[1].revents & POLLIN)
+        {
+            /* stop or new watchdog */
+            
+            if (read(self->chip_wake, &wake, sizeof(wake)) < 0) break;
+            continue;
+        }
+        
+        if (n == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            
+            tick = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+            
+            self->tick_ext = tick;
+            
+            _timeout(self, tick);
+            continue;
+        }
+        
+        n = read(self->chip_fd, ev, sizeof(ev));
+        
+        if (n < 0)
+        {
+            if ((errno == EINTR) || (errno == EAGAIN)) continue;
+            break;
+        }
+        
+        n /= sizeof(ev[0]);
+        
+        for (i=0; i<n; i++)
+        {
+            if (ev[i].id != GPIO_V2_LINE_EVENT_RISING_EDGE) continue;
+            
+            tick = ev[i].timestamp_ns / 1000;
+            
+            self->tick_ext = tick;
+            
+            /* the kernel drops events when its queue is full */
+            
+            gap = ev[i].line_seqno - self->chip_seqno - 1;
+            
+            if (self->chip_seqno_have && gap) _missed(self, gap, tick);
+            
+            self->chip_seqno = ev[i].line_seqno;
+            self->chip_seqno_have = 1;
+            
+            _rising(self, tick, self->bits);
+        }
+        
+        _decode_end(self);
+    }
+    
+    return NULL;
+}
+
+static int _chip_subscribe(METER_t *self, const char *chip)
+{
+    struct gpio_v2_line_request req;
+    int fd, err;
+    
+    fd = open(chip, O_RDONLY | O_CLOEXEC);
+    
+    if (fd < 0) return -1;
+    
+    memset(&req, 0, sizeof(req));
+    
+    req.offsets[0] = self->meterGPIO;
+    req.num_lines = 1;
+    strncpy(req.consumer, "METER", sizeof(req.consumer)-1);
+    _chip_config(&req.config, self->glitch);
+    
+    err = ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req);
+    
+    close(fd);
+    
+    if (err < 0) return -1;
+    
+    self->chip_fd = req.fd;
+    
+    self->chip_wake = eventfd(0, EFD_CLOEXEC);
+    
+    if (self->chip_wake < 0) return -1;
+    
+    if (pthread_create(&self->chip_thread, NULL, _chip_thread, self))
+    {
+        close(self->chip_wake);
+        self->chip_wake = -1;
+        return -1;
+    }
+    
+    self->cb_id = 0;
+    
+    return 0;
+}
+
+static void _chip_wake(METER_t *self)
+{
+    uint64_t one = 1;
+    
+    if (write(self->chip_wake, &one, sizeof(one)) < 0) perror("METER");
+}
+
+static void _chip_unsubscribe(METER_t *self)
+{
+    atomic_store(&self->chip_stop, 1);
+    _chip_wake(self);
+    pthread_join(self->chip_thread, NULL);
+    
+    self->cb_id = -1;
+}
+
+static int _chip_glitch(METER_t *self, unsigned glitch)
+{
+    struct gpio_v2_line_config config;
+    
+    if (self->chip_fd < 0) return -1;
+    
+    _chip_config(&config, glitch);
+    
+    return ioctl(self->chip_fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &config);
+}
+
+static int _chip_watchdog(METER_t *self, unsigned timeout)
+{
+    atomic_store(&self->chip_watchdog, timeout);
+    _chip_wake(self);
+    
+    return 0;
+}
+
+static void _gpio_setup(METER_t *self)
+{
+    if (self->backend == METER_BACKEND_PIGPIO) _pig_setup(self);
+}
+
+static int _gpio_glitch(METER_t *self, unsigned glitch)
+{
+    if (self->backend == METER_BACKEND_GPIOCHIP) return _chip_glitch(self, glitch);
+    
+    return _pig_glitch(self, glitch);
+}
+
+static int _gpio_watchdog(METER_t *self, unsigned timeout)
+{
+    if (self->backend == METER_BACKEND_GPIOCHIP) return _chip_watchdog(self, timeout);
+    
+    return _pig_watchdog(self, timeout);
+}
+
+/*
+ Pulses held back by METER_set_notify are only looked at when more
+ arrive, so when the input stops the watchdog has to signal them.
+ It is armed for the shorter of the caller's timeout and the notify
+ age, and _timeout only reports idle once the caller's has passed.
+ */
+
+static int _watchdog_arm(METER_t *self)
+{
+    unsigned timeout, age;
+    int err;
+    
+    timeout = self->watchdog;
+    
+    age = (atomic_load(&self->notify_usecs) + 999) / 1000;
+    
+    if (age > 60000) age = 60000;
+    
+    if (age && (!timeout || (age < timeout))) timeout = age;
+    
+    if (timeout == self->watchdog_armed) return 0;
+    
+    err = _gpio_watchdog(self, timeout);
+    
+    if (err < 0) return err;
+    
+    self->watchdog_armed = timeout;
+    
+    return 0;
+}
+
+static uint32_t _gpio_tick(METER_t *self)
+{
+    struct timespec ts;
+    
+    if (self->backend == METER_BACKEND_GPIOCHIP)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+    
+    return _pig_tick(self);
+}
+
+static void _unsubscribe(METER_t *self)
+{
+    if (self->backend == METER_BACKEND_GPIOCHIP) _chip_unsubscribe(self);
+    else _pig_unsubscribe(self);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static METER_t *_new(int backend, int pi, int meterGPIO, uint64_t start_meter_value, uint32_t min_tick_difference, METER_CB_t cb_func)
+{
+    METER_t *self;
+    int i;
+    
+    /* the ring indices live on their own cache lines */
+    
+    if (posix_memalign((void **)&self, METER_CACHE_LINE, sizeof(METER_t)))
+        return NULL;
+    
+    self->pi = pi;
+    self->meterGPIO = meterGPIO;
+    self->cb = cb_func;
+    self->cancel_deferred = 0;
+    self->batch_cb = NULL;
+    self->event_cb = NULL;
+    self->cb_id = -1;
+    self->bits = 0;
+    self->levels = 0;
+    self->owner = self;
+    self->backend = backend;
+    self->chip_fd = -1;
+    self->chip_wake = -1;
+    atomic_init(&self->chip_stop, 0);
+    atomic_init(&self->chip_watchdog, 0);
+    memset(self->chan, 0, sizeof(self->chan));
+    self->watchdog = 0;
+    self->watchdog_armed = 0;
+    self->idle = 1;             /* until the first pulse */
+    self->notify_lost = 0;
+    self->chip_seqno_have = 0;
+    self->chip_seqno = 0;
+    atomic_init(&self->lost, 0);
+    self->batch_count = 0;
+    self->batch_delta = 0;
+    self->batch_published = 0;
+    self->batch_value = 0;
+    self->quadGPIO = -1;
+    self->mode = METER_MODE_STEP;
+    self->oldState = -1;
+    self->steps = 0;
+    self->tick_ext = 0;
+    self->tick_host = 0;
+    for (i=0; i<METER_SECONDS; i++)
+    {
+        atomic_init(&self->sec[i].stamp, 0);
+        atomic_init(&self->sec[i].count, 0);
+    }
+    for (i=0; i<METER_MINUTES; i++)
+    {
+        atomic_init(&self->min[i].stamp, 0);
+        atomic_init(&self->min[i].count, 0);
+    }
+    pthread_mutex_init(&self->clock_mutex, NULL);
+    self->clock_have = 0;
+    self->clock_tick = 0;
+    self->clock_wall = 0.0;
+    self->clock_drift = 0.0;
+    self->clock_rtt = 0;
+    atomic_init(&self->now_tick, 0);
+    atomic_init(&self->now_host, 0);
+    atomic_init(&self->notify_fd, -1);
+    atomic_init(&self->notify_count, 1);
+    atomic_init(&self->notify_usecs, 0);
+    self->notify_pending = 0;
+    self->notify_first = 0;
+    atomic_init(&self->state, NULL);
+    self->state_fd = -1;
+    self->state_seq = 0;
+    self->state_base = start_meter_value;
+    self->state_restored = 0;
+    atomic_init(&self->seq, 0);
+    atomic_init(&self->meter_value, start_meter_value);
+    atomic_init(&self->last_tick, 0);
+    self->registered = 0;
+    self->reg_next = NULL;
+    atomic_init(&self->ring_head, 0);
+    self->ring_tail = 0;
+    self->ring_lost = 0;
+    atomic_init(&self->rate_gen, 0);
+    atomic_init(&self->rate_filter_req, METER_RATE_EWMA);
+    atomic_init(&self->rate_param_req, METER_RATE_DEFAULT_ALPHA);
+    self->rate_seen_gen = 0;
+    self->have_prev = 0;
+    self->prev_tick = 0;
+    for (i=0; i<METER_HIST_BUCKETS; i++)
+    {
+        atomic_init(&self->hist[i], 0);
+        self->hist_base[i] = 0;
+    }
+    atomic_init(&self->hist_max, 0);
+    _rate_reset(self, 0);
+    atomic_init(&self->rate, 0.0);
+    self->glitch=0;
+    atomic_init(&self->min_interval, min_tick_difference);
+    self->accept_have = 0;
+    self->accept_tick = 0;
+    atomic_init(&self->reject_count, 0);
+    atomic_init(&self->reject_min, UINT32_MAX);
+    atomic_init(&self->reject_tick, 0);
+    
+    if (meterGPIO >= 0) _gpio_setup(self);
+    
+    return self;
+}
+
+static void _release(METER_t *self)
+{
+    _unregister(self);
+    
+    if (self->meterGPIO >= 0)
+    {
+        if (self->glitch) _gpio_glitch(self, 0);
+        
+        if (self->watchdog_armed) _gpio_watchdog(self, 0);
+    }
+    
+    pthread_mutex_destroy(&self->clock_mutex);
+    
+    if (self->chip_fd >= 0) close(self->chip_fd);
+    
+    if (self->chip_wake >= 0) close(self->chip_wake);
+    
+    if (atomic_load(&self->notify_fd) >= 0) close(atomic_load(&self->notify_fd));
+    
+    if (self->state_fd >= 0)
+    {
+        METER_sync(self);
+        munmap(atomic_load(&self->state), sizeof(METER_state_t));
+        close(self->state_fd);
+    }
+    
+    free(self);
+}
+
+/* PUBLIC ----------------------------------------------------------------- */
+
+METER_t *METER(int pi, int meterGPIO, uint64_t start_meter_value, uint32_t min_tick_difference, METER_CB_t cb_func)
+{
+    METER_t *self;
+    
+    self = _new(METER_BACKEND_PIGPIO, pi, meterGPIO,
+                start_meter_value, min_tick_difference, cb_func);
+    
+    if (!self) return NULL;
+    
+    self->bits = 1<<meterGPIO;
+    self->chan[meterGPIO] = self;
+    
+    _register(self);
+    
+    if (_pig_subscribe(self) < 0)
+    {
+        METER_cancel(self);
+        return NULL;
+    }
+    
+    return self;
+}
+
+METER_t *METER_quadrature(int pi, int gpioA, int gpioB, int mode, uint64_t start_meter_value, METER_CB_t cb_func)
+{
+    METER_t *self;
+    
+    self = _new(METER_BACKEND_PIGPIO, pi, -1, start_meter_value, 0, cb_func);
+    
+    if (!self) return NULL;
+    
+    self->meterGPIO = gpioA;
+    self->quadGPIO = gpioB;
+    self->mode = mode;
+    
+    _gpio_setup(self);
+    
+    self->bits = (1<<gpioA) | (1<<gpioB);
+    self->chan[gpioA] = self;
+    self->chan[gpioB] = self;
+    
+    _register(self);
+    
+    if (_pig_subscribe(self) < 0)
+    {
+        METER_cancel(self);
+        return NULL;
+    }
+    
+    return self;
+}
+
+METER_t *METER_gpiochip(const char *chip, int line, uint64_t start_meter_value, uint32_t min_tick_difference, METER_CB_t cb_func)
+{
+    METER_t *self;
+    
+    if ((line < 0) || (line > 31)) return NULL;
+    
+    self = _new(METER_BACKEND_GPIOCHIP, -1, line,
+                start_meter_value, min_tick_difference, cb_func);
+    
+    if (!self) return NULL;
+    
+    self->bits = 1<<line;
+    self->chan[line] = self;
+    
+    _register(self);
+    
+    if (_chip_subscribe(self, chip) < 0)
+    {
+        METER_cancel(self);
+        return NULL;
+    }
+    
+    return self;
+}
+
+METER_t *METER_multi(int pi, uint32_t gpios, uint64_t start_meter_value, uint32_t min_tick_difference)
+{
+    METER_t *self;
+    uint32_t bits;
+    int g;
+    
+    self = _new(METER_BACKEND_PIGPIO, pi, -1, 0, 0, NULL);
+    
+    if (!self) return NULL;
+    
+    self->bits = gpios;
+    
+    for (bits=gpios; bits; bits&=bits-1)
+    {
+        g = __builtin_ctz(bits);
+        
+        self->chan[g] =
+           _new(METER_BACKEND_PIGPIO, pi, g,
+                start_meter_value, min_tick_difference, NULL);
+        
+        if (!self->chan[g])
+        {
+            METER_cancel(self);
+            return NULL;
+        }
+        
+        self->chan[g]->owner = self;
+        
+        _register(self->chan[g]);
+    }
+    
+    if (_pig_subscribe(self) < 0)
+    {
+        METER_cancel(self);
+        return NULL;
+    }
+    
+    return self;
+}
+
+METER_t *METER_channel(METER_t *self, int gpio)
+{
+    if ((gpio < 0) || (gpio > 31) || !(self->bits & (1<<gpio))) return NULL;
+    
+    return self->chan[gpio];
+}
+
+void METER_cancel(METER_t *self)
+{
+    uint32_t bits;
+    int g;
+    
+    if (self && (self->owner == self))
+    {
+        
+        if (self->cb_id >= 0) _unsubscribe(self);
+        
+        /* cancelled from its own callback, finished after it returns */
+        
+        if (self->cancel_deferred) return;
+        
+        for (bits=self->bits; bits; bits&=bits-1)
+        {
+            g = __builtin_ctz(bits);
+            
+            if (self->chan[g] && (self->chan[g] != self)) _release(self->chan[g]);
+        }
+        
+        _release(self);
+    }
+}
+
+uint64_t METER_get_position(METER_t *self)
+{
+    return atomic_load_explicit(&self->meter_value, memory_order_relaxed);
+}
+
+void METER_get_snapshot(METER_t *self, METER_snapshot_t *snap)
+{
+    uint32_t seq1, seq2;
+    
+    do
+    {
+        seq1 = atomic_load_explicit(&self->seq, memory_order_acquire);
+        snap->value = atomic_load_explicit(&self->meter_value, memory_order_relaxed);
+        snap->tick = atomic_load_explicit(&self->last_tick, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        seq2 = atomic_load_explicit(&self->seq, memory_order_relaxed);
+    }
+    while ((seq1 & 1) || (seq1 != seq2));
+}
+
+int METER_snapshot_all(METER_t **meters, METER_snapshot_t *snaps, int n)
+{
+    METER_t *p;
+    uint64_t seq1, seq2;
+    int count;
+    
+    pthread_mutex_lock(&gRegMutex);
+    
+    do
+    {
+        seq1 = atomic_load_explicit(&gRegSeq, memory_order_acquire);
+        
+        count = 0;
+        
+        for (p=gRegFirst; p; p=p->reg_next)
+        {
+            if (count < n)
+            {
+                if (meters) meters[count] = p;
+                
+                snaps[count].value =
+                   atomic_load_explicit(&p->meter_value, memory_order_relaxed);
+                snaps[count].tick =
+                   atomic_load_explicit(&p->last_tick, memory_order_relaxed);
+            }
+            
+            count++;
+        }
+        
+        atomic_thread_fence(memory_order_acquire);
+        seq2 = atomic_load_explicit(&gRegSeq, memory_order_relaxed);
+    }
+    while ((seq1 & METER_REG_ACTIVE) || (seq1 != seq2));
+    
+    pthread_mutex_unlock(&gRegMutex);
+    
+    return count;
+}
+
+int METER_drain(METER_t *self, uint64_t *buf, int n)
+{
+    uint64_t head, tail, stale;
+    int count, i;
+    
+    if (n <= 0) return 0;
+    
+    tail = self->ring_tail;
+    
+    head = atomic_load_explicit(&self->ring_head, memory_order_acquire);
+    
+    /* the slot at head may be being rewritten, so one entry less is safe */
+    
+    if ((head - tail) >= METER_RING_SIZE)
+    {
+        self->ring_lost += head - tail - (METER_RING_SIZE-1);
+        tail = head - (METER_RING_SIZE-1);
+    }
+    
+    if ((head - tail) < n) count = head - tail; else count = n;
+    
+    for (i=0; i<count; i++)
+        buf[i] = atomic_load_explicit(&self->ring[(tail+i) & METER_RING_MASK],
+                                      memory_order_relaxed);
+    
+    /* discard anything the producer lapped while we were copying */
+    
+    atomic_thread_fence(memory_order_acquire);
+    
+    head = atomic_load_explicit(&self->ring_head, memory_order_relaxed);
+    
+    if ((head - tail) >= METER_RING_SIZE)
+    {
+        stale = head - tail - (METER_RING_SIZE-1);
+        if (stale > count) stale = count;
+        
+        memmove(buf, buf+stale, (count-stale)*sizeof(*buf));
+        
+        count -= stale;
+        tail += stale;
+        self->ring_lost += stale;
+    }
+    
+    self->ring_tail = tail + count;
+    
+    return count;
+}
+
+void METER_set_batch_callback(METER_t *self, METER_BATCH_CB_t batch_cb)
+{
+    self->batch_cb = batch_cb;
+}
+
+void METER_set_rate_filter(METER_t *self, int filter, double param)
+{
+    int gen;
+    
+    /* picked up by _cb at the next pulse */
+    
+    gen = atomic_load_explicit(&self->rate_gen, memory_order_relaxed);
+    
+    while ((gen & 1) ||
+           !atomic_compare_exchange_weak_explicit(
+              &self->rate_gen, &gen, gen+1,
+              memory_order_relaxed, memory_order_relaxed))
+    {
+        gen = atomic_load_explicit(&self->rate_gen, memory_order_relaxed);
+    }
+    
+    atomic_thread_fence(memory_order_release);
+    
+    atomic_store_explicit(&self->rate_filter_req, filter, memory_order_relaxed);
+    atomic_store_explicit(&self->rate_param_req, param, memory_order_relaxed);
+    
+    atomic_store_explicit(&self->rate_gen, gen+2, memory_order_release);
+}
+
+void METER_get_interval_stats(METER_t *self, METER_interval_stats_t *stats, int reset)
+{
+    uint64_t count[METER_HIST_BUCKETS];
+    uint64_t total, sum, rank50, rank90, rank99;
+    int b;
+    
+    /* counts since the last reset */
+    
+    total = 0;
+    
+    for (b=0; b<METER_HIST_BUCKETS; b++)
+    {
+        count[b] = atomic_load_explicit(&self->hist[b], memory_order_relaxed) -
+                   self->hist_base[b];
+        total += count[b];
+    }
+    
+    if (reset)
+    {
+        for (b=0; b<METER_HIST_BUCKETS; b++) self->hist_base[b] += count[b];
+        
+        stats->max = atomic_exchange_explicit(&self->hist_max, 0,
+                                              memory_order_relaxed);
+    }
+    else
+        stats->max = atomic_load_explicit(&self->hist_max, memory_order_relaxed);
+    
+    stats->count = total;
+    stats->p50 = stats->p90 = stats->p99 = 0;
+    
+    if (!total) return;
+    
+    /* ranks of the percentiles, rounded up */
+    
+    rank50 = (total * 50 + 99) / 100;
+    rank90 = (total * 90 + 99) / 100;
+    rank99 = (total * 99 + 99) / 100;
+    
+    sum = 0;
+    
+    for (b=0; b<METER_HIST_BUCKETS; b++)
+    {
+        if (!count[b]) continue;
+        
+        if (sum < rank50 && sum + count[b] >= rank50) stats->p50 = _hist_upper(b);
+        if (sum < rank90 && sum + count[b] >= rank90) stats->p90 = _hist_upper(b);
+        if (sum < rank99 && sum + count[b] >= rank99) stats->p99 = _hist_upper(b);
+        
+        sum += count[b];
+        
+        if (sum >= rank99) break;
+    }
+    
+    /* a bucket's upper bound may lie beyond the largest interval seen */
+    
+    if (stats->max)
+    {
+        if (stats->p50 > stats->max) stats->p50 = stats->max;
+        if (stats->p90 > stats->max) stats->p90 = stats->max;
+        if (stats->p99 > stats->max) stats->p99 = stats->max;
+    }
+}
+
+double METER_get_rate(METER_t *self)
+{
+    return atomic_load_explicit(&self->rate, memory_order_relaxed);
+}
+
+/*
+ The tick is related to CLOCK_REALTIME by reading both, the realtime
+ clock either side of the tick.  Each sample corrects the predicted
+ wall time of its tick by a share of the error, and the drift by a
+ share of the error's rate (an alpha-beta filter).  Samples which
+ took much longer than the best recent one are not trusted.  Times
+ are found from the low 32 bits of a tick as a signed distance from
+ the reference, so ticks within half a wrap (35 minutes) of the last
+ sample convert correctly.
+ */
+
+int METER_clock_update(METER_t *self)
+{
+    struct timespec t0, t1;
+    uint32_t tick, rtt;
+    double wall, dt, predicted, err;
+    
+    self = self->owner;
+    
+    clock_gettime(CLOCK_REALTIME, &t0);
+    tick = _gpio_tick(self);
+    clock_gettime(CLOCK_REALTIME, &t1);
+    
+    rtt = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+    
+    wall = (t0.tv_sec + t1.tv_sec) / 2.0 + (t0.tv_nsec + t1.tv_nsec) / 2e9;
+    
+    pthread_mutex_lock(&self->clock_mutex);
+    
+    if (self->clock_rtt && (rtt > 2 * self->clock_rtt + 100))
+    {
+        /* let the best time age so a slower link is accepted in time */
+        
+        self->clock_rtt += self->clock_rtt / 8 + 1;
+        
+        pthread_mutex_unlock(&self->clock_mutex);
+        return -1;
+    }
+    
+    if (!self->clock_rtt || (rtt < self->clock_rtt)) self->clock_rtt = rtt;
+    
+    dt = (int32_t)(tick - self->clock_tick) / 1e6;
+    
+    if (!self->clock_have || (dt <= 0.0) ||
+        ((wall - self->clock_wall) > METER_CLOCK_STALE))
+    {
+        self->clock_tick = tick;
+        self->clock_wall = wall;
+        self->clock_have = 1;
+        
+        pthread_mutex_unlock(&self->clock_mutex);
+        return 0;
+    }
+    
+    predicted = self->clock_wall + dt * (1.0 + self->clock_drift);
+    
+    err = wall - predicted;
+    
+    if ((err > METER_CLOCK_STEP) || (err < -METER_CLOCK_STEP))
+    {
+        /* the realtime clock was stepped, start again from here */
+        
+        self->clock_wall = wall;
+    }
+    else
+    {
+        self->clock_wall = predicted + METER_CLOCK_ALPHA * err;
+        self->clock_drift += METER_CLOCK_BETA * err / dt;
+        
+        if (self->clock_drift >  METER_CLOCK_DRIFT) self->clock_drift =  METER_CLOCK_DRIFT;
+        if (self->clock_drift < -METER_CLOCK_DRIFT) self->clock_drift = -METER_CLOCK_DRIFT;
+    }
+    
+    self->clock_tick = tick;
+    
+    pthread_mutex_unlock(&self->clock_mutex);
+    
+    return 0;
+}
+
+int METER_tick_to_time(METER_t *self, uint64_t tick, struct timespec *ts)
+{
+    double wall;
+    
+    self = self->owner;
+    
+    pthread_mutex_lock(&self->clock_mutex);
+    
+    if (!self->clock_have)
+    {
+        pthread_mutex_unlock(&self->clock_mutex);
+        return -1;
+    }
+    
+    wall = self->clock_wall +
+           (int32_t)((uint32_t)tick - self->clock_tick) / 1e6 *
+           (1.0 + self->clock_drift);
+    
+    pthread_mutex_unlock(&self->clock_mutex);
+    
+    ts->tv_sec = wall;
+    ts->tv_nsec = (wall - ts->tv_sec) * 1e9;
+    
+    if (ts->tv_nsec < 0) ts->tv_nsec = 0;
+    if (ts->tv_nsec > 999999999) ts->tv_nsec = 999999999;
+    
+    return 0;
+}
+
+uint64_t METER_count_between(METER_t *self, uint64_t t0, uint64_t t1)
+{
+    uint64_t now;
+    
+    if (t1 <= t0) return 0;
+    
+    now = _now(self) / METER_SEC_USECS;
+    
+    /* seconds while the whole range is still held, otherwise minutes */
+    
+    if ((now < METER_SECONDS) || (t0 / METER_SEC_USECS > now - METER_SECONDS))
+        return _bucket_sum(self->sec, METER_SECONDS,
+                           t0 / METER_SEC_USECS, (t1-1) / METER_SEC_USECS);
+    
+    return _bucket_sum(self->min, METER_MINUTES,
+                       t0 / METER_MIN_USECS, (t1-1) / METER_MIN_USECS);
+}
+
+uint64_t METER_count_last(METER_t *self, unsigned seconds)
+{
+    uint64_t now, minutes;
+    
+    if (!seconds) return 0;
+    
+    now = _now(self);
+    
+    if (seconds <= METER_SECONDS)
+    {
+        now /= METER_SEC_USECS;
+        
+        if (seconds > now) return _bucket_sum(self->sec, METER_SECONDS, 0, now);
+        
+        return _bucket_sum(self->sec, METER_SECONDS, now-seconds+1, now);
+    }
+    
+    now /= METER_MIN_USECS;
+    minutes = (seconds + 59) / 60;
+    
+    if (minutes > now) return _bucket_sum(self->min, METER_MINUTES, 0, now);
+    
+    return _bucket_sum(self->min, METER_MINUTES, now-minutes+1, now);
+}
+
+int METER_get_fd(METER_t *self)
+{
+    int fd, old;
+    
+    old = atomic_load(&self->notify_fd);
+    
+    if (old >= 0) return old;
+    
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    
+    if (fd < 0) return -1;
+    
+    /* another thread may have got there first */
+    
+    if (!atomic_compare_exchange_strong(&self->notify_fd, &old, fd))
+    {
+        close(fd);
+        return old;
+    }
+    
+    return fd;
+}
+
+int METER_set_notify(METER_t *self, uint32_t count, uint32_t usecs)
+{
+    atomic_store(&self->notify_count, count);
+    atomic_store(&self->notify_usecs, usecs);
+    
+    return _watchdog_arm(self);
+}
+
+uint64_t METER_get_lost(METER_t *self)
+{
+    return atomic_load_explicit(&self->lost, memory_order_relaxed);
+}
+
+uint64_t METER_get_drain_lost(METER_t *self)
+{
+    return self->ring_lost;
+}
+
+void METER_set_position(METER_t *self, uint64_t value)
+{
+    uint32_t seq;
+    
+    seq = _write_begin(self);
+    atomic_store_explicit(&self->meter_value, value, memory_order_relaxed);
+    self->state_base = value;
+    _state_write(self, value,
+                 atomic_load_explicit(&self->last_tick, memory_order_relaxed));
+    _write_end(self, seq);
+}
+
+int METER_set_state_file(METER_t *self, const char *path)
+{
+    METER_state_t *state;
+    METER_record_t *rec, *best;
+    uint64_t value;
+    uint32_t seq;
+    int fd, i;
+    
+    if (self->state_fd >= 0) return -1;
+    
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    
+    if (fd < 0) return -1;
+    
+    if (ftruncate(fd, sizeof(METER_state_t)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    
+    state = mmap(NULL, sizeof(METER_state_t), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+    
+    if (state == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+    
+    best = NULL;
+    
+    if ((state->magic == METER_STATE_MAGIC) &&
+        (state->version == METER_STATE_VERSION))
+    {
+        for (i=0; i<2; i++)
+        {
+            rec = &state->rec[i];
+            
+            if (rec->check != _record_check(rec)) continue;
+            
+            if (!best || (rec->seq > best->seq)) best = rec;
+        }
+    }
+    else
+    {
+        memset(state, 0, sizeof(METER_state_t));
+        state->magic = METER_STATE_MAGIC;
+        state->version = METER_STATE_VERSION;
+    }
+    
+    seq = _write_begin(self);
+    
+    value = atomic_load_explicit(&self->meter_value, memory_order_relaxed);
+    
+    if (best)
+    {
+        /* keep the pulses counted since the meter started */
+        
+        self->state_seq = best->seq;
+        value = best->value + (value - self->state_base);
+        self->state_base = best->value;
+        atomic_store_explicit(&self->meter_value, value, memory_order_relaxed);
+        
+        self->state_restored = 1;
+        self->state_tick = best->tick;
+        self->state_time.tv_sec = best->sec;
+        self->state_time.tv_nsec = best->nsec;
+    }
+    
+    self->state_fd = fd;
+    atomic_store_explicit(&self->state, state, memory_order_release);
+    
+    _state_write(self, value,
+                 atomic_load_explicit(&self->last_tick, memory_order_relaxed));
+    
+    _write_end(self, seq);
+    
+    return 0;
+}
+
+int METER_get_state_time(METER_t *self, uint64_t *tick, struct timespec *ts)
+{
+    if (!self->state_restored) return -1;
+    
+    if (tick) *tick = self->state_tick;
+    if (ts) *ts = self->state_time;
+    
+    return 0;
+}
+
+int METER_sync(METER_t *self)
+{
+    METER_state_t *state;
+    
+    state = atomic_load_explicit(&self->state, memory_order_acquire);
+    
+    if (!state) return 0;
+    
+    return msync(state, sizeof(METER_state_t), MS_SYNC);
+}
+
+void METER_set_min_interval(METER_t *self, uint32_t min_tick_difference)
+{
+    atomic_store_explicit(&self->min_interval, min_tick_difference,
+                          memory_order_relaxed);
+}
+
+void METER_get_debounce_stats(METER_t *self, METER_debounce_stats_t *stats)
+{
+    stats->rejected =
+       atomic_load_explicit(&self->reject_count, memory_order_relaxed);
+    stats->min_interval =
+       atomic_load_explicit(&self->reject_min, memory_order_relaxed);
+    stats->last_tick =
+       atomic_load_explicit(&self->reject_tick, memory_order_relaxed);
+    
+    if (!stats->rejected) stats->min_interval = 0;
+}
+
+void METER_set_event_callback(METER_t *self, METER_EVENT_CB_t event_cb)
+{
+    self->event_cb = event_cb;
+}
+
+int METER_set_watchdog(METER_t *self, unsigned timeout)
+{
+    unsigned old;
+    int err;
+    
+    old = self->watchdog;
+    self->watchdog = timeout;
+    
+    err = _watchdog_arm(self);
+    
+    if (err < 0) self->watchdog = old;
+    
+    return err;
 }
 
 void METER_set_glitch_filter(METER_t *self, int glitch)
@@ -105,7 +2478,7 @@ void METER_set_glitch_filter(METER_t *self, int glitch)
         if (self->glitch != glitch)
         {
             self->glitch = glitch;
-            set_glitch_filter(self->pi, self->meterGPIO, glitch);
+            _gpio_glitch(self, glitch);
         }
     }
 }
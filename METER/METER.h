@@ -7,32 +7,249 @@
 #ifndef METER_H
 #define METER_H
 
-typedef void (*METER_CB_t)(uint32_t,uint32_t);
+#include <stdint.h>
+#include <time.h>
+
+typedef void (*METER_CB_t)(uint64_t,uint64_t);
+
+typedef void (*METER_BATCH_CB_t)(uint64_t,const uint64_t *,int);
+
+typedef void (*METER_EVENT_CB_t)(int,uint64_t,uint64_t);
 
 struct _METER_s;
 
 typedef struct _METER_s METER_t;
 
+typedef struct
+{
+    uint64_t value;
+    uint64_t tick;
+} METER_snapshot_t;
+
+typedef struct
+{
+    uint64_t rejected;     /* edges dropped by the debounce */
+    uint32_t min_interval; /* shortest rejected interval, 0 if none */
+    uint64_t last_tick;    /* tick of the last rejected edge */
+} METER_debounce_stats_t;
+
+typedef struct
+{
+    uint64_t count;        /* intervals recorded */
+    uint64_t p50;          /* interval percentiles in microseconds */
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t max;
+} METER_interval_stats_t;
+
 #define METER_MODE_DETENT 0
 #define METER_MODE_STEP   1
 
+/* pulse ticks kept for METER_drain, must be a power of 2 */
+
+#define METER_RING_SIZE 4096
+
+#define METER_EVENT_IDLE 0
+#define METER_EVENT_LOST 1
+
+/* pulse count history, one bucket per second and per minute */
+
+#define METER_SECONDS 3600
+#define METER_MINUTES 1440
+
+#define METER_RATE_EWMA   0
+#define METER_RATE_WINDOW 1
+
+#define METER_RATE_DEFAULT_ALPHA 0.25
+#define METER_RATE_WINDOW_MAX    64
+
 /*
  
- METER starts a rotary encoder on Pi pi with GPIO gpioA,
- GPIO gpioB, mode mode, and callback cb_func.  The mode
- determines whether the four steps in each detent are
- reported as changes or just the detents.
+ METER starts a pulse counter on Pi pi with GPIO gpioB,
+ initial position start_meter_value, and callback cb_func.
+ Each rising edge on the gpio adds one to the position.
  
  If cb_func in not null it will be called at each position
  change with the new position.
  
+ METER_quadrature starts a bidirectional counter on the
+ quadrature (rotary encoder style) outputs gpioA and gpioB,
+ e.g. a flow meter with a direction output.  A leading B counts
+ up, B leading A counts down.  The levels are decoded with a
+ state transition table.  The mode determines whether the four
+ steps in each detent are counted (METER_MODE_STEP) or just the
+ detents (METER_MODE_DETENT).  No glitch filter is set, so
+ nothing limits the edge rate; METER_set_glitch_filter sets one
+ on both gpios.  The ring, rate and callbacks see every counted
+ step whatever its direction.
+ 
+ METER normally talks to pigpiod through pigpiod_if2 and pi is
+ the value returned by pigpio_start.  When compiled with
+ METER_LIBPIGPIO defined it uses libpigpio in process instead,
+ avoiding the daemon socket and notify thread; pi is then
+ ignored and gpioInitialise must have been called.  Its callbacks
+ run without METER's locks held and may call any METER function.
+ A meter cancelled from one of its own callbacks is released when
+ the callback returns; the rest of that batch may still be
+ reported first.
+ 
+ METER_gpiochip counts rising edges on line (0-31) of a Linux
+ GPIO character device such as "/dev/gpiochip0", without pigpio.
+ Edges are timestamped by the kernel and read in batches by a
+ thread which sleeps until the kernel has events, so an idle
+ meter costs no CPU.  Its ticks are CLOCK_MONOTONIC microseconds
+ rather than pigpio ticks.  The glitch filter is applied as the
+ kernel line debounce.  It returns NULL if the line can't be
+ requested.  It can be tried on any Linux box with gpio-sim.
+ 
+ METER_multi counts rising edges on every gpio set in the bit
+ mask gpios through a single pigpiod subscription.  Each report
+ is decoded once for all the gpios, so the cost of a report does
+ not grow with the number of meters.  METER_channel returns the
+ meter for one of the gpios; all the functions below except
+ METER_cancel may be used on it.  The channels have no cb_func,
+ but batch and event callbacks may be set per channel.  The
+ handle returned by METER_multi does not count pulses itself;
+ cancelling it cancels all its channels.
+ 
+ All ticks handed out by METER are pigpio microsecond ticks
+ extended to 64 bits, so they do not wrap every 71.6 minutes and
+ intervals may be found by plain subtraction.  The low 32 bits
+ equal the pigpio tick.
+ 
+ Pulses are taken from pigpiod a report batch at a time.  If a
+ batch callback has been set with METER_set_batch_callback it is
+ called once per batch with the position after the batch, the
+ ticks of the batch's pulses, and their count.  Either callback,
+ both, or neither may be used.  With many pulses per second the
+ batch callback is much cheaper than cb_func.
+ 
  The current position can be read with METER_get_position and
- set with METER_set_position.
+ set with METER_set_position.  The counter is 64 bits wide and
+ may be read from any thread without locking.
+ 
+ METER_clock_update relates the tick to CLOCK_REALTIME: it reads
+ the current tick (over the pigpiod socket unless in process) and
+ the wall clock around it.  Offset and drift are filtered across
+ calls, so it should be called regularly, every few seconds to
+ every few minutes, and at least every 30 minutes.  It returns 0
+ if the sample was used, -1 if it took too long to be trusted.
+ METER_tick_to_time converts a tick, e.g. of a snapshot, into the
+ wall clock time of the pulse.  The tick must be within 35 minutes
+ of the last update.  It returns 0 if OK, -1 before the first
+ update.
+ 
+ METER_get_snapshot returns the current position together with
+ the tick of the pulse which produced it.  The pair is always
+ consistent, i.e. the tick belongs to the value.  Readers never
+ block the pulse callback; they retry if they overlap an update.
+ 
+ METER_snapshot_all does the same for every meter in the process
+ at once, e.g. to subtract sub-meters from a house total.  It
+ copies up to n meters, in the order they were started, with
+ their snapshots into meters (which may be NULL) and snaps, and
+ returns the number of meters, which may exceed n.  The copies
+ all belong to the same instant: pulse callbacks never wait for
+ the reader, the reader retries if any meter was updated while it
+ copied.  The handle returned by METER_multi is not included, its
+ channels are.
+ 
+ The tick of every pulse is also recorded in a ring of
+ METER_RING_SIZE entries.  METER_drain copies up to n ticks which
+ arrived since the previous drain into buf, oldest first, and
+ returns the number copied.  Only one thread may drain a meter.
+ If the ring is not drained quickly enough the oldest ticks are
+ overwritten; METER_get_drain_lost returns how many were lost.
+ 
+ METER_get_fd returns an eventfd which becomes readable when new
+ pulses have been counted, so a meter can be waited on with poll,
+ epoll or io_uring alongside other work.  Reading 8 bytes from it
+ returns the number of pulses since the previous read and makes it
+ unreadable again.  The fd is created by the first call, pulses
+ counted before then are not signalled, and it is closed by
+ METER_cancel.  It returns -1 if the eventfd can't be
+ created.  By default the fd is signalled after every report
+ batch.  METER_set_notify coalesces the wakeups: the pulses are
+ signalled once count have collected or the oldest is usecs
+ microseconds old (either may be 0 to ignore it).  For the age to
+ hold when the input stops, usecs arms the watchdog (see below),
+ rounded up to milliseconds, unless a shorter one is set; a
+ timeout signals whatever is pending.  It returns 0 if OK,
+ otherwise a pigpio error code.
+ 
+ METER_set_state_file makes the position survive restarts and
+ power cuts.  The position, tick and wall-clock time of the last
+ update are kept in a small memory mapped file using two
+ checksummed records written alternately.  If the file already
+ holds a valid record the position is restored from the newest
+ one, replacing start_meter_value; pulses counted since the meter
+ was created are added to it.  Updates are plain memory writes;
+ METER_sync (e.g. once per flush period) forces them to disk.  It
+ returns 0 if OK, otherwise -1.
+
+ METER_get_state_time gives the tick and wall-clock time of the
+ record restored, i.e. of the last update before the restart.  The
+ tick is only meaningful to the pigpio run which wrote it.  It
+ returns 0 if OK, otherwise -1 if nothing was restored.
+ 
+ METER_get_rate returns the current rate in pulses per second,
+ estimated from the intervals between consecutive pulses.  It is
+ 0 until two pulses have been seen.  By default the intervals are
+ smoothed by an EWMA with weight METER_RATE_DEFAULT_ALPHA.
+ METER_set_rate_filter selects METER_RATE_EWMA with param the
+ weight (0-1] of the newest interval, or METER_RATE_WINDOW with
+ param the number of intervals (1-METER_RATE_WINDOW_MAX) averaged.
+ The estimator restarts from the next pulse.
+ 
+ Each meter also counts its pulses per second for the last
+ METER_SECONDS seconds and per minute for the last METER_MINUTES
+ minutes, whatever their direction.  METER_count_between returns
+ the pulses with ticks from t0 up to t1, in whole seconds if the
+ range is within the last hour, otherwise in whole minutes, so
+ the partial periods at each end count in full.  METER_count_last
+ returns the pulses in the current second and the seconds-1
+ before it (in minutes beyond an hour).  Periods older than the
+ history count as 0.  Both may be called from any thread.
+ 
+ Every interval between counted pulses is also recorded in a
+ fixed size histogram with logarithmic buckets, accurate to 1/8
+ of the interval.  METER_get_interval_stats returns the number
+ of intervals, their 50th, 90th and 99th percentiles and the
+ maximum.  If reset is non zero the histogram restarts after
+ the read.  Only one thread may read the statistics.
+ 
+ METER_set_watchdog arms the pigpio watchdog for the gpio with a
+ timeout of 1-60000 milliseconds (0 disarms it).  When no pulse
+ arrives within the timeout the rate is decayed toward zero,
+ and on the first timeout after a pulse the callback set with
+ METER_set_event_callback is called with METER_EVENT_IDLE, the
+ position, and the tick of the timeout.  This tells a stopped
+ meter apart from a stalled pipeline.  METER_set_watchdog
+ returns 0 if OK, otherwise a pigpio error code.
+ 
+ pigpiod numbers its reports and drops them rather than block
+ when the client falls behind.  Each gap in the numbers is counted
+ as possibly lost pulses: METER_get_lost returns the total number
+ of reports missed since the meter started, and the event callback
+ is called with METER_EVENT_LOST, the position, and the tick of
+ the batch after the gap.  The position is then a lower bound.
+ A gpiochip meter counts the events dropped by the kernel the same
+ way.  With METER_LIBPIGPIO there are no numbers to check and the
+ count stays 0.
  
- Mechanical encoders may suffer from switch bounce.
- METER_set_glitch_filter may be used to filter out edges
- shorter than glitch microseconds.  By default a glitch
- filter of 1000 microseconds is used.
+ Mechanical encoders and S0 outputs may suffer from switch
+ bounce.  A rising edge less than min_tick_difference
+ microseconds after the previous accepted edge is ignored.
+ The minimum may be changed with METER_set_min_interval and
+ METER_get_debounce_stats reports how many edges were ignored,
+ the shortest such interval, and the tick of the last one.
+ Quadrature meters ignore the minimum: a bounce steps back and
+ forth and cancels itself, whereas dropping part of it would not.
+ 
+ METER_set_glitch_filter may additionally be used to set the
+ pigpio glitch filter, which discards level changes shorter
+ than glitch microseconds.  It applies to the gpio as a whole
+ and delays every edge by glitch.  By default it is not set.
  
  At program end the rotary encoder should be cancelled using
  METER_cancel.  This releases system resources.
@@ -41,16 +258,84 @@ typedef struct _METER_s METER_t;
 
 METER_t *METER                   (int pi,
                                   int gpioB,
-                                  uint32_t start_meter_value,
+                                  uint64_t start_meter_value,
+                                  uint32_t min_tick_difference,
+                                  METER_CB_t cb_func);
+
+METER_t *METER_quadrature        (int pi,
+                                  int gpioA,
+                                  int gpioB,
+                                  int mode,
+                                  uint64_t start_meter_value,
+                                  METER_CB_t cb_func);
+
+METER_t *METER_gpiochip          (const char *chip,
+                                  int line,
+                                  uint64_t start_meter_value,
                                   uint32_t min_tick_difference,
                                   METER_CB_t cb_func);
 
+METER_t *METER_multi             (int pi,
+                                  uint32_t gpios,
+                                  uint64_t start_meter_value,
+                                  uint32_t min_tick_difference);
+
+METER_t *METER_channel           (METER_t *renc, int gpio);
+
 void   METER_cancel            (METER_t *renc);
 
 void   METER_set_glitch_filter (METER_t *renc, int glitch);
 
-void   METER_set_position      (METER_t *renc, uint32_t position);
+void   METER_set_min_interval  (METER_t *renc, uint32_t min_tick_difference);
+
+void   METER_get_debounce_stats(METER_t *renc, METER_debounce_stats_t *stats);
+
+void   METER_set_batch_callback(METER_t *renc, METER_BATCH_CB_t cb_func);
+
+void   METER_set_position      (METER_t *renc, uint64_t position);
+
+int    METER_set_state_file    (METER_t *renc, const char *path);
+
+int    METER_get_state_time    (METER_t *renc, uint64_t *tick, struct timespec *ts);
+
+int    METER_sync              (METER_t *renc);
+
+uint64_t    METER_get_position (METER_t *renc);
+
+void   METER_get_snapshot      (METER_t *renc, METER_snapshot_t *snap);
+
+int    METER_clock_update      (METER_t *renc);
+
+int    METER_tick_to_time      (METER_t *renc, uint64_t tick, struct timespec *ts);
+
+int    METER_snapshot_all      (METER_t **meters,
+                                METER_snapshot_t *snaps,
+                                int n);
+
+int    METER_drain             (METER_t *renc, uint64_t *buf, int n);
+
+uint64_t    METER_get_drain_lost (METER_t *renc);
+
+uint64_t    METER_get_lost     (METER_t *renc);
+
+uint64_t    METER_count_between(METER_t *renc, uint64_t t0, uint64_t t1);
+
+uint64_t    METER_count_last   (METER_t *renc, unsigned seconds);
+
+int    METER_get_fd            (METER_t *renc);
+
+int    METER_set_notify        (METER_t *renc, uint32_t count, uint32_t usecs);
+
+void   METER_set_rate_filter   (METER_t *renc, int filter, double param);
+
+int    METER_set_watchdog      (METER_t *renc, unsigned timeout);
+
+void   METER_set_event_callback(METER_t *renc, METER_EVENT_CB_t cb_func);
+
+double METER_get_rate          (METER_t *renc);
 
-uint32_t    METER_get_position (METER_t *renc);
+void   METER_get_interval_stats(METER_t *renc,
+                                METER_interval_stats_t *stats,
+                                int reset);
 
 #endif
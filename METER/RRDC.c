@@ -0,0 +1,772 @@
+/*
+ RRDC.c
+ 2016-02-10
+ Public Domain
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "RRDC.h"
+
+/* PRIVATE ---------------------------------------------------------------- */
+
+#define RRDC_READ_SIZE 4096
+
+#define RRDC_QUEUE_MAX   (1024*1024) /* bytes of updates kept while down */
+#define RRDC_CONNECT_MS  5000        /* to give up on a connect */
+#define RRDC_BACKOFF_MIN 250         /* first retry after a failure */
+#define RRDC_BACKOFF_MAX 60000
+#define RRDC_RESOLVE_MS  300000      /* addresses are cached this long */
+
+/* what the next reply line is */
+
+#define RRDC_WAIT_GO      0   /* 0 Go ahead ... */
+#define RRDC_WAIT_SUMMARY 1   /* <n> errors */
+#define RRDC_WAIT_ERRORS  2   /* <command number> <message> */
+
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t size;
+} RRDC_buf_t;
+
+/*
+ A lookup is shared by the client and its resolver thread, and freed
+ by whichever of them lets go of it last.  The thread signals the
+ eventfd when the result is in.
+ */
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+    int refs;
+    int efd;
+    int done;
+    int err;
+    char *host;
+    char *port;
+    struct addrinfo *res;
+} RRDC_lookup_t;
+
+struct _RRDC_s
+{
+    char *host;
+    char *port;
+    int fd;
+    
+    int link;               /* RRDC_DOWN ... RRDC_UP */
+    unsigned fd_changes;    /* descriptors handed out */
+    int wanted;             /* RRDC_connect asked, retry when due */
+    RRDC_lookup_t *lookup;  /* while RRDC_RESOLVING */
+    struct addrinfo *addrs; /* cached result of the last lookup */
+    struct addrinfo *addr;  /* address being tried */
+    uint64_t addrs_expire;
+    uint64_t deadline;      /* of the connect, or of the backoff */
+    unsigned backoff;
+    unsigned seed;
+    
+    RRDC_buf_t batch;       /* updates queued for the next flush */
+    int batch_count;
+    RRDC_buf_t out;         /* flushed batches not yet written */
+    RRDC_buf_t in;          /* reply bytes not yet parsed */
+    
+    int outstanding;        /* batches sent whose replies are due */
+    int state;
+    int error_lines;        /* error lines still to come */
+    unsigned errors;
+    unsigned dropped;
+    unsigned answered;      /* batches whose replies are in */
+    unsigned lost;          /* batches whose replies never came */
+};
+
+static uint64_t _millis(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int _buf_add(RRDC_buf_t *buf, const char *data, size_t len)
+{
+    char *p;
+    size_t size;
+    
+    if (buf->len + len > buf->size)
+    {
+        size = buf->size ? buf->size : 1024;
+        
+        while (size < buf->len + len) size *= 2;
+        
+        p = realloc(buf->data, size);
+        
+        if (!p) return -1;
+        
+        buf->data = p;
+        buf->size = size;
+    }
+    
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    
+    return 0;
+}
+
+static void _buf_drop(RRDC_buf_t *buf, size_t len)
+{
+    memmove(buf->data, buf->data + len, buf->len - len);
+    buf->len -= len;
+}
+
+static void _lookup_put(RRDC_lookup_t *lookup)
+{
+    int refs;
+    
+    pthread_mutex_lock(&lookup->mutex);
+    refs = --lookup->refs;
+    pthread_mutex_unlock(&lookup->mutex);
+    
+    if (refs) return;
+    
+    if (lookup->res) freeaddrinfo(lookup->res);
+    
+    close(lookup->efd);
+    pthread_mutex_destroy(&lookup->mutex);
+    free(lookup->host);
+    free(lookup->port);
+    free(lookup);
+}
+
+static void *_lookup_thread(void *arg)
+{
+    RRDC_lookup_t *lookup = arg;
+    struct addrinfo hints, *res;
+    uint64_t one = 1;
+    int err;
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    
+    err = getaddrinfo(lookup->host, lookup->port, &hints, &res);
+    
+    pthread_mutex_lock(&lookup->mutex);
+    lookup->err = err;
+    lookup->res = err ? NULL : res;
+    lookup->done = 1;
+    pthread_mutex_unlock(&lookup->mutex);
+    
+    if (write(lookup->efd, &one, sizeof(one)) != sizeof(one)) {}
+    
+    _lookup_put(lookup);
+    
+    return NULL;
+}
+
+/* batches sent or being sent are lost with the connection */
+
+static void _disconnect(RRDC_t *self)
+{
+    if (self->fd >= 0) close(self->fd);
+    
+    if (self->outstanding)
+    {
+        fprintf(stderr, "rrdcached: %d batches lost\n", self->outstanding);
+        self->lost += self->outstanding;
+    }
+    
+    self->fd = -1;
+    self->out.len = 0;
+    self->in.len = 0;
+    self->outstanding = 0;
+    self->state = RRDC_WAIT_GO;
+    self->link = RRDC_DOWN;
+}
+
+/*
+ After a failure the next attempt waits a random time between half
+ and all of the backoff, which doubles up to RRDC_BACKOFF_MAX, so
+ clients restarted together do not retry together.
+ */
+
+static void _fail(RRDC_t *self)
+{
+    unsigned delay;
+    
+    _disconnect(self);
+    
+    delay = self->backoff / 2 + rand_r(&self->seed) % (self->backoff / 2 + 1);
+    
+    fprintf(stderr, "rrdcached: %s:%s unavailable, retry in %u ms\n",
+       self->host, self->port, delay);
+    
+    self->link = RRDC_BACKOFF;
+    self->deadline = _millis() + delay;
+    
+    self->backoff *= 2;
+    
+    if (self->backoff > RRDC_BACKOFF_MAX) self->backoff = RRDC_BACKOFF_MAX;
+}
+
+static int _resolve(RRDC_t *self)
+{
+    RRDC_lookup_t *lookup;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int err;
+    
+    lookup = calloc(1, sizeof(RRDC_lookup_t));
+    
+    if (!lookup) return -1;
+    
+    lookup->refs = 2;
+    lookup->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    lookup->host = strdup(self->host);
+    lookup->port = strdup(self->port);
+    
+    pthread_mutex_init(&lookup->mutex, NULL);
+    
+    err = (lookup->efd < 0) || !lookup->host || !lookup->port;
+    
+    if (!err)
+    {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        
+        err = pthread_create(&thread, &attr, _lookup_thread, lookup);
+        
+        pthread_attr_destroy(&attr);
+    }
+    
+    if (err)
+    {
+        if (lookup->efd >= 0) close(lookup->efd);
+        
+        pthread_mutex_destroy(&lookup->mutex);
+        free(lookup->host);
+        free(lookup->port);
+        free(lookup);
+        return -1;
+    }
+    
+    self->lookup = lookup;
+    self->link = RRDC_RESOLVING;
+    self->fd_changes++;
+    
+    return 0;
+}
+
+static int _send(RRDC_t *self);
+
+static void _up(RRDC_t *self)
+{
+    int one = 1;
+    
+    setsockopt(self->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    self->link = RRDC_UP;
+    self->backoff = RRDC_BACKOFF_MIN;
+    self->wanted = 0;
+    
+    _send(self);
+}
+
+/*
+ Starts a non-blocking connect to addr or, if that fails at once, to
+ the addresses after it.  When none is left the client backs off.
+ */
+
+static void _try(RRDC_t *self, struct addrinfo *addr)
+{
+    int fd;
+    
+    for (; addr; addr=addr->ai_next)
+    {
+        fd = socket(addr->ai_family,
+           addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addr->ai_protocol);
+        
+        if (fd < 0) continue;
+        
+        self->fd = fd;
+        self->fd_changes++;
+        self->addr = addr;
+        
+        if (!connect(fd, addr->ai_addr, addr->ai_addrlen))
+        {
+            _up(self);
+            return;
+        }
+        
+        if (errno == EINPROGRESS)
+        {
+            self->link = RRDC_CONNECTING;
+            self->deadline = _millis() + RRDC_CONNECT_MS;
+            return;
+        }
+        
+        close(fd);
+        self->fd = -1;
+    }
+    
+    _fail(self);
+}
+
+static void _connected(RRDC_t *self)
+{
+    socklen_t len;
+    int err;
+    
+    len = sizeof(err);
+    
+    if (getsockopt(self->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+    
+    if (err == 0)
+    {
+        _up(self);
+        return;
+    }
+    
+    close(self->fd);
+    self->fd = -1;
+    
+    _try(self, self->addr->ai_next);
+}
+
+static void _resolved(RRDC_t *self)
+{
+    RRDC_lookup_t *lookup = self->lookup;
+    uint64_t count;
+    int done, err;
+    
+    if (read(lookup->efd, &count, sizeof(count)) != sizeof(count)) {}
+    
+    pthread_mutex_lock(&lookup->mutex);
+    done = lookup->done;
+    err = lookup->err;
+    self->addrs = lookup->res;
+    lookup->res = NULL;
+    pthread_mutex_unlock(&lookup->mutex);
+    
+    if (!done) return;
+    
+    self->lookup = NULL;
+    
+    /*
+     The eventfd is let go only once the socket is open, so the two
+     never share a number.
+     */
+    
+    if (err)
+    {
+        fprintf(stderr, "rrdcached: no such host %s, %s\n",
+           self->host, gai_strerror(err));
+        _fail(self);
+    }
+    else
+    {
+        self->addrs_expire = _millis() + RRDC_RESOLVE_MS;
+        
+        _try(self, self->addrs);
+    }
+    
+    _lookup_put(lookup);
+}
+
+/*
+ Moves the connection on as far as it can without waiting: a due
+ retry is started, from the cached addresses while they are fresh,
+ and a connect past its deadline moves on to the next address.
+ */
+
+static void _step(RRDC_t *self)
+{
+    uint64_t now = _millis();
+    
+    switch (self->link)
+    {
+        case RRDC_BACKOFF:
+            if (now < self->deadline) break;
+            
+            self->link = RRDC_DOWN;
+            
+            /* fall through */
+        
+        case RRDC_DOWN:
+            if (self->addrs && (now >= self->addrs_expire))
+            {
+                freeaddrinfo(self->addrs);
+                self->addrs = NULL;
+            }
+            
+            if (self->addrs) _try(self, self->addrs);
+            else if (_resolve(self) < 0) _fail(self);
+            break;
+        
+        case RRDC_CONNECTING:
+            if (now < self->deadline) break;
+            
+            fprintf(stderr, "rrdcached: connect to %s:%s timed out\n",
+               self->host, self->port);
+            
+            close(self->fd);
+            self->fd = -1;
+            
+            _try(self, self->addr->ai_next);
+            break;
+    }
+}
+
+static int _write(RRDC_t *self)
+{
+    ssize_t n;
+    
+    while (self->out.len)
+    {
+        n = send(self->fd, self->out.data, self->out.len, MSG_NOSIGNAL);
+        
+        if (n < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 0;
+            if (errno == EINTR) continue;
+            
+            fprintf(stderr, "rrdcached: write failed, %s\n", strerror(errno));
+            _fail(self);
+            return -1;
+        }
+        
+        _buf_drop(&self->out, n);
+    }
+    
+    return 0;
+}
+
+/*
+ A batch is answered by a go ahead line when it starts and a count
+ of the failed updates when it ends, followed by one line per
+ failure.  The batches are sent back to back, so their replies are
+ parsed in turn.
+ */
+
+static int _line(RRDC_t *self, char *line)
+{
+    long status;
+    
+    if (!self->outstanding) return 0;
+    
+    status = strtol(line, NULL, 10);
+    
+    switch (self->state)
+    {
+        case RRDC_WAIT_GO:
+            if (status < 0)
+            {
+                /* what follows would be taken as single commands */
+                
+                fprintf(stderr, "rrdcached: batch refused, %s\n", line);
+                _fail(self);
+                return -1;
+            }
+            self->state = RRDC_WAIT_SUMMARY;
+            break;
+        
+        case RRDC_WAIT_SUMMARY:
+            if (status > 0)
+            {
+                self->errors += status;
+                self->error_lines = status;
+                self->state = RRDC_WAIT_ERRORS;
+            }
+            else
+            {
+                self->outstanding--;
+                self->answered++;
+                self->state = RRDC_WAIT_GO;
+            }
+            break;
+        
+        case RRDC_WAIT_ERRORS:
+            fprintf(stderr, "rrdcached: update %s\n", line);
+            
+            if (!--self->error_lines)
+            {
+                self->outstanding--;
+                self->answered++;
+                self->state = RRDC_WAIT_GO;
+            }
+            break;
+    }
+    
+    return 0;
+}
+
+static int _read(RRDC_t *self)
+{
+    char buf[RRDC_READ_SIZE];
+    char *nl;
+    size_t used;
+    ssize_t n;
+    
+    while (1)
+    {
+        n = recv(self->fd, buf, sizeof(buf), 0);
+        
+        if (n == 0)
+        {
+            fprintf(stderr, "rrdcached: connection closed\n");
+            _fail(self);
+            return -1;
+        }
+        
+        if (n < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 0;
+            if (errno == EINTR) continue;
+            
+            fprintf(stderr, "rrdcached: read failed, %s\n", strerror(errno));
+            _fail(self);
+            return -1;
+        }
+        
+        if (_buf_add(&self->in, buf, n) < 0)
+        {
+            fprintf(stderr, "rrdcached: out of memory\n");
+            _fail(self);
+            return -1;
+        }
+        
+        used = 0;
+        
+        while ((nl = memchr(self->in.data + used, '\n', self->in.len - used)))
+        {
+            *nl = 0;
+            
+            if (_line(self, self->in.data + used) < 0) return -1;
+            
+            used = nl - self->in.data + 1;
+        }
+        
+        _buf_drop(&self->in, used);
+    }
+}
+
+/* frames the queued updates as one batch and starts writing it */
+
+static int _send(RRDC_t *self)
+{
+    if (!self->batch_count) return 0;
+    
+    if ((_buf_add(&self->out, "BATCH\n", 6) < 0) ||
+        (_buf_add(&self->out, self->batch.data, self->batch.len) < 0) ||
+        (_buf_add(&self->out, ".\n", 2) < 0))
+    {
+        _fail(self);
+        return -1;
+    }
+    
+    self->batch.len = 0;
+    self->batch_count = 0;
+    self->outstanding++;
+    
+    return _write(self);
+}
+
+/* PUBLIC ----------------------------------------------------------------- */
+
+RRDC_t *RRDC(const char *host, const char *port)
+{
+    RRDC_t *self;
+    
+    self = calloc(1, sizeof(RRDC_t));
+    
+    if (!self) return NULL;
+    
+    self->host = strdup(host);
+    self->port = strdup(port);
+    self->fd = -1;
+    self->state = RRDC_WAIT_GO;
+    self->link = RRDC_DOWN;
+    self->backoff = RRDC_BACKOFF_MIN;
+    self->seed = time(NULL) ^ getpid();
+    
+    if (!self->host || !self->port)
+    {
+        RRDC_cancel(self);
+        return NULL;
+    }
+    
+    return self;
+}
+
+int RRDC_update(RRDC_t *self, const char *file, const char *values)
+{
+    size_t len;
+    char *line;
+    int err;
+    
+    if (self->batch.len >= RRDC_QUEUE_MAX)
+    {
+        self->dropped++;
+        return -1;
+    }
+    
+    len = strlen(file) + strlen(values) + 10;
+    
+    line = malloc(len);
+    
+    if (!line) return -1;
+    
+    snprintf(line, len, "update %s %s\n", file, values);
+    
+    err = _buf_add(&self->batch, line, strlen(line));
+    
+    free(line);
+    
+    if (err < 0) return -1;
+    
+    self->batch_count++;
+    
+    return 0;
+}
+
+int RRDC_flush(RRDC_t *self)
+{
+    if (self->link == RRDC_UP) return _send(self);
+    
+    if (self->batch_count) _step(self);
+    
+    return (self->link == RRDC_UP) ? 0 : -1;
+}
+
+int RRDC_connect(RRDC_t *self)
+{
+    if (self->link != RRDC_UP)
+    {
+        self->wanted = 1;
+        _step(self);
+    }
+    
+    return (self->link == RRDC_UP) ? 0 : -1;
+}
+
+int RRDC_state(RRDC_t *self)
+{
+    return self->link;
+}
+
+int RRDC_fd(RRDC_t *self)
+{
+    if (self->link == RRDC_RESOLVING) return self->lookup->efd;
+    
+    return self->fd;
+}
+
+unsigned RRDC_fd_changes(RRDC_t *self)
+{
+    return self->fd_changes;
+}
+
+int RRDC_want_write(RRDC_t *self)
+{
+    if (self->link == RRDC_CONNECTING) return 1;
+    
+    return (self->link == RRDC_UP) && self->out.len;
+}
+
+int RRDC_timeout(RRDC_t *self)
+{
+    uint64_t now;
+    
+    if ((self->link != RRDC_CONNECTING) && (self->link != RRDC_BACKOFF))
+        return -1;
+    
+    /* a lapsed backoff with nothing to send waits for the next flush */
+    
+    if ((self->link == RRDC_BACKOFF) && !self->batch_count && !self->wanted)
+        return -1;
+    
+    now = _millis();
+    
+    return (now < self->deadline) ? (int)(self->deadline - now) : 0;
+}
+
+int RRDC_io(RRDC_t *self, int readable, int writable)
+{
+    switch (self->link)
+    {
+        case RRDC_RESOLVING:
+            if (readable) _resolved(self);
+            break;
+        
+        case RRDC_CONNECTING:
+            if (readable || writable) _connected(self);
+            else _step(self);
+            break;
+        
+        case RRDC_UP:
+            if (writable && (_write(self) < 0)) return -1;
+            
+            if (readable && (_read(self) < 0)) return -1;
+            break;
+        
+        default:
+            if (self->batch_count || self->wanted) _step(self);
+            break;
+    }
+    
+    return (self->link == RRDC_BACKOFF) ? -1 : 0;
+}
+
+unsigned RRDC_get_errors(RRDC_t *self)
+{
+    return self->errors;
+}
+
+unsigned RRDC_get_dropped(RRDC_t *self)
+{
+    return self->dropped;
+}
+
+unsigned RRDC_get_answered(RRDC_t *self)
+{
+    return self->answered;
+}
+
+unsigned RRDC_get_lost(RRDC_t *self)
+{
+    return self->lost;
+}
+
+void RRDC_cancel(RRDC_t *self)
+{
+    if (!self) return;
+    
+    _disconnect(self);
+    
+    /* a lookup still running frees itself */
+    
+    if (self->lookup) _lookup_put(self->lookup);
+    
+    if (self->addrs) freeaddrinfo(self->addrs);
+    
+    free(self->batch.data);
+    free(self->out.data);
+    free(self->in.data);
+    free(self->host);
+    free(self->port);
+    free(self);
+}
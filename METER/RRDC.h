@@ -0,0 +1,118 @@
+/*
+ RRDC.h
+ 2016-02-10
+ Public Domain
+ */
+
+#ifndef RRDC_H
+#define RRDC_H
+
+struct _RRDC_s;
+
+typedef struct _RRDC_s RRDC_t;
+
+/* RRDC_state */
+
+#define RRDC_DOWN       0
+#define RRDC_RESOLVING  1
+#define RRDC_CONNECTING 2
+#define RRDC_UP         3
+#define RRDC_BACKOFF    4
+
+/*
+
+ RRDC is a client for rrdcached which keeps one connection open and
+ sends updates in BATCH mode, so many updates cost one write and no
+ round trips.
+
+ Nothing blocks.  The host is looked up on a thread of its own and
+ the addresses are cached for five minutes; connects are non-blocking
+ and time out after five seconds.  After a failure the client backs
+ off, from a quarter second doubling up to a minute, with jitter.
+
+ RRDC creates a client for the daemon at host and port.  Nothing is
+ sent until the first flush.  It returns NULL if out of memory.
+
+ RRDC_update queues an update of file with values, as given to
+ rrdtool update, e.g. "N:42" or "1455100000.250:42".  Updates for any
+ number of files and times may be queued.  It returns 0 if OK,
+ otherwise -1 if a megabyte of updates is already queued, in which
+ case the update is dropped.
+
+ RRDC_flush sends all queued updates as one batch if connected,
+ otherwise it starts connecting if a retry is due.  It returns 0 if
+ the batch is sent, otherwise -1; the updates then stay queued and
+ go as one batch once connected.
+
+ RRDC_connect starts connecting if not connected and a retry is due,
+ without queueing anything.  Until connected, RRDC_timeout then
+ counts down to each retry as if updates were queued.  It returns 0
+ if connected, otherwise -1.
+
+ RRDC_state returns RRDC_UP when connected.  Otherwise the client is
+ RRDC_DOWN, RRDC_RESOLVING, RRDC_CONNECTING, or RRDC_BACKOFF while
+ waiting to retry, and its updates are being queued.
+
+ RRDC_fd returns the descriptor to poll, the socket or while
+ resolving an eventfd, or -1 if there is none.  It should be polled
+ for input, and for output while RRDC_want_write is non zero.
+ RRDC_fd_changes returns a count which goes up whenever RRDC_fd
+ gives a new descriptor, even one with the number of a closed one,
+ which must then be polled afresh.
+ RRDC_timeout returns the milliseconds until the client must be
+ called without input or output, or -1 if never.  RRDC_io must then
+ be called with whether the descriptor is readable and whether it is
+ writable (both 0 if the timeout expired).  It moves the connection
+ on, sends what is queued and parses the replies; errors reported by
+ rrdcached are printed on stderr.  It returns 0 if OK, or -1 if the
+ connection was lost or could not be made.  The descriptor may
+ differ afterwards.
+
+ RRDC_get_errors returns the number of updates rrdcached rejected.
+
+ RRDC_get_dropped returns the number of updates dropped because too
+ many were queued.
+
+ RRDC_get_answered returns the number of batches rrdcached has
+ answered, whether or not some of their updates were rejected.  A
+ batch lost with its connection is never answered.
+
+ RRDC_get_lost returns the number of batches sent, in part or whole,
+ whose connection was lost before they were answered.  Their updates
+ may or may not have been made.
+
+ RRDC_cancel closes the connection and frees the client.
+
+ */
+
+RRDC_t *RRDC              (const char *host, const char *port);
+
+int    RRDC_update        (RRDC_t *rrdc, const char *file, const char *values);
+
+int    RRDC_flush         (RRDC_t *rrdc);
+
+int    RRDC_connect       (RRDC_t *rrdc);
+
+int    RRDC_state         (RRDC_t *rrdc);
+
+int    RRDC_fd            (RRDC_t *rrdc);
+
+unsigned RRDC_fd_changes  (RRDC_t *rrdc);
+
+int    RRDC_want_write    (RRDC_t *rrdc);
+
+int    RRDC_timeout       (RRDC_t *rrdc);
+
+int    RRDC_io            (RRDC_t *rrdc, int readable, int writable);
+
+unsigned RRDC_get_errors  (RRDC_t *rrdc);
+
+unsigned RRDC_get_dropped (RRDC_t *rrdc);
+
+unsigned RRDC_get_answered(RRDC_t *rrdc);
+
+unsigned RRDC_get_lost    (RRDC_t *rrdc);
+
+void   RRDC_cancel        (RRDC_t *rrdc);
+
+#endif
@@ -0,0 +1,377 @@
+/*
+ SPOOL.c
+ 2016-02-10
+ Public Domain
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/stat.h>
+
+#include "SPOOL.h"
+
+/* PRIVATE ---------------------------------------------------------------- */
+
+#define SPOOL_SCAN 1024 /* records read at a time */
+
+#define SPOOL_COMPACT (1024*1024) /* consumed bytes before compacting */
+
+struct _SPOOL_s
+{
+    char *path;
+    int fd;
+    off_t head;             /* first record not consumed */
+    off_t end;              /* end of the records on disk */
+    
+    SPOOL_record_t *pending; /* appended, not yet synced */
+    int pending_count;
+    int pending_size;
+};
+
+static uint32_t _check(SPOOL_record_t *rec)
+{
+    const uint8_t *p;
+    uint32_t hash;
+    int i;
+    
+    /* FNV-1a over everything but the check word, never 0 */
+    
+    p = (const uint8_t *)rec;
+    hash = 2166136261u;
+    
+    for (i=0; i<offsetof(SPOOL_record_t, check); i++)
+    {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    
+    return hash ? hash : 1;
+}
+
+static int _pread(int fd, void *buf, size_t len, off_t pos)
+{
+    ssize_t n;
+    
+    while (len)
+    {
+        n = pread(fd, buf, len, pos);
+        
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        
+        if (n == 0) return -1;
+        
+        buf = (char *)buf + n;
+        len -= n;
+        pos += n;
+    }
+    
+    return 0;
+}
+
+static int _pwrite(int fd, const void *buf, size_t len, off_t pos)
+{
+    ssize_t n;
+    
+    while (len)
+    {
+        n = pwrite(fd, buf, len, pos);
+        
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        
+        buf = (const char *)buf + n;
+        len -= n;
+        pos += n;
+    }
+    
+    return 0;
+}
+
+/*
+ Consumed records are zero at the head of the file and the records
+ proper follow.  The first record which doesn't check ends the file.
+ */
+
+static int _scan(SPOOL_t *self)
+{
+    SPOOL_record_t recs[SPOOL_SCAN];
+    struct stat st;
+    off_t pos;
+    int n, i, zero;
+    
+    if (fstat(self->fd, &st) < 0) return -1;
+    
+    zero = 1;
+    pos = 0;
+    
+    while (pos + (off_t)sizeof(SPOOL_record_t) <= st.st_size)
+    {
+        n = (st.st_size - pos) / sizeof(SPOOL_record_t);
+        
+        if (n > SPOOL_SCAN) n = SPOOL_SCAN;
+        
+        if (_pread(self->fd, recs, n * sizeof(SPOOL_record_t), pos) < 0)
+            return -1;
+        
+        for (i=0; i<n; i++)
+        {
+            if (zero && !recs[i].check)
+            {
+                pos += sizeof(SPOOL_record_t);
+                self->head = pos;
+                continue;
+            }
+            
+            zero = 0;
+            
+            if (recs[i].check != _check(&recs[i])) break;
+            
+            pos += sizeof(SPOOL_record_t);
+        }
+        
+        if (i < n) break;
+    }
+    
+    if (pos == self->head) self->head = pos = 0;
+    
+    if (pos < st.st_size)
+    {
+        if (pos) fprintf(stderr, "spool: dropped %lld torn bytes\n",
+                    (long long)(st.st_size - pos));
+        
+        if (ftruncate(self->fd, pos) < 0) return -1;
+    }
+    
+    self->end = pos;
+    
+    return 0;
+}
+
+/*
+ The records not yet consumed are copied to a new file which then
+ replaces the spool, so a crash leaves one or the other whole.
+ */
+
+static int _compact(SPOOL_t *self)
+{
+    SPOOL_record_t recs[SPOOL_SCAN];
+    char *tmp;
+    off_t pos, out;
+    size_t len;
+    int fd;
+    
+    tmp = malloc(strlen(self->path) + 5);
+    
+    if (!tmp) return -1;
+    
+    sprintf(tmp, "%s.tmp", self->path);
+    
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    
+    if (fd < 0)
+    {
+        free(tmp);
+        return -1;
+    }
+    
+    out = 0;
+    
+    for (pos=self->head; pos<self->end; pos+=len)
+    {
+        len = self->end - pos;
+        
+        if (len > sizeof(recs)) len = sizeof(recs);
+        
+        if ((_pread(self->fd, recs, len, pos) < 0) ||
+            (_pwrite(fd, recs, len, out) < 0)) break;
+        
+        out += len;
+    }
+    
+    if ((pos < self->end) || (fdatasync(fd) < 0) || (rename(tmp, self->path) < 0))
+    {
+        fprintf(stderr, "spool: compact failed, %s\n", strerror(errno));
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    
+    free(tmp);
+    
+    close(self->fd);
+    
+    self->fd = fd;
+    self->head = 0;
+    self->end = out;
+    
+    return 0;
+}
+
+static int _cmp(const void *a, const void *b)
+{
+    const SPOOL_record_t *x = a, *y = b;
+    
+    if (x->micros != y->micros) return (x->micros > y->micros) ? 1 : -1;
+    
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+/* PUBLIC ----------------------------------------------------------------- */
+
+SPOOL_t *SPOOL(const char *path)
+{
+    SPOOL_t *self;
+    
+    self = calloc(1, sizeof(SPOOL_t));
+    
+    if (!self) return NULL;
+    
+    self->path = strdup(path);
+    self->fd = self->path ? open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644) : -1;
+    
+    if ((self->fd < 0) || (_scan(self) < 0))
+    {
+        SPOOL_cancel(self);
+        return NULL;
+    }
+    
+    return self;
+}
+
+int SPOOL_append(SPOOL_t *self, uint64_t micros, uint32_t id, uint64_t value)
+{
+    SPOOL_record_t *rec;
+    int size;
+    
+    if (self->pending_count == self->pending_size)
+    {
+        size = self->pending_size ? self->pending_size * 2 : 64;
+        
+        rec = realloc(self->pending, size * sizeof(SPOOL_record_t));
+        
+        if (!rec) return -1;
+        
+        self->pending = rec;
+        self->pending_size = size;
+    }
+    
+    rec = &self->pending[self->pending_count++];
+    
+    rec->micros = micros;
+    rec->value = value;
+    rec->id = id;
+    rec->check = _check(rec);
+    
+    return 0;
+}
+
+int SPOOL_sync(SPOOL_t *self)
+{
+    size_t len;
+    
+    if (!self->pending_count) return 0;
+    
+    len = self->pending_count * sizeof(SPOOL_record_t);
+    
+    if ((_pwrite(self->fd, self->pending, len, self->end) < 0) ||
+        (fdatasync(self->fd) < 0))
+    {
+        /* a partial write is overwritten by the next sync */
+        
+        fprintf(stderr, "spool: write failed, %s\n", strerror(errno));
+        return -1;
+    }
+    
+    self->end += len;
+    self->pending_count = 0;
+    
+    return 0;
+}
+
+int SPOOL_count(SPOOL_t *self)
+{
+    return (self->end - self->head) / sizeof(SPOOL_record_t);
+}
+
+int SPOOL_read(SPOOL_t *self, SPOOL_record_t *recs, int count)
+{
+    if (count > SPOOL_count(self)) count = SPOOL_count(self);
+    
+    if (count <= 0) return 0;
+    
+    if (_pread(self->fd, recs, count * sizeof(SPOOL_record_t), self->head) < 0)
+        return -1;
+    
+    qsort(recs, count, sizeof(SPOOL_record_t), _cmp);
+    
+    return count;
+}
+
+int SPOOL_consume(SPOOL_t *self, int count)
+{
+    SPOOL_record_t zero[SPOOL_SCAN];
+    off_t pos, end;
+    size_t len;
+    
+    if (count >= SPOOL_count(self))
+    {
+        if (ftruncate(self->fd, 0) < 0) return -1;
+        
+        self->head = self->end = 0;
+        return 0;
+    }
+    
+    memset(zero, 0, sizeof(zero));
+    
+    pos = self->head;
+    end = pos + (off_t)count * sizeof(SPOOL_record_t);
+    
+    while (pos < end)
+    {
+        len = end - pos;
+        
+        if (len > sizeof(zero)) len = sizeof(zero);
+        
+        if (_pwrite(self->fd, zero, len, pos) < 0) return -1;
+        
+        pos += len;
+    }
+    
+    self->head = end;
+    
+    /* the zeroed head is only worth copying away once it dominates */
+    
+    if ((self->head >= SPOOL_COMPACT) && (self->head >= self->end - self->head))
+        _compact(self);
+    
+    return 0;
+}
+
+void SPOOL_cancel(SPOOL_t *self)
+{
+    if (!self) return;
+    
+    if (self->fd >= 0)
+    {
+        SPOOL_sync(self);
+        close(self->fd);
+    }
+    
+    free(self->pending);
+    free(self->path);
+    free(self);
+}
@@ -0,0 +1,76 @@
+/*
+ SPOOL.h
+ 2016-02-10
+ Public Domain
+ */
+
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdint.h>
+
+struct _SPOOL_s;
+
+typedef struct _SPOOL_s SPOOL_t;
+
+typedef struct
+{
+    uint64_t micros;       /* wall clock time of the sample */
+    uint64_t value;
+    uint32_t id;           /* which meter */
+    uint32_t check;
+} SPOOL_record_t;
+
+/*
+
+ SPOOL is a write-ahead log of samples for a sink which may be down.
+ Each sample is appended to the spool file before it is sent, and
+ dropped from the file once the sink has taken it, so samples taken
+ while the sink is down, or before a restart, are sent later.
+
+ Records are 24 bytes, appended in the order given.  The file is only
+ ever appended to, except that consumed records are zeroed, and the
+ file is emptied once all are consumed.  Once a megabyte or more of
+ consumed records outweighs the rest, the rest is copied to a new
+ file which replaces the spool.  A record torn by a crash is
+ found by its check word and cut off when the spool is opened.
+
+ SPOOL opens or creates the spool file at path and finds the records
+ left in it.  It returns NULL if the file can't be opened.
+
+ SPOOL_append adds a sample of value for meter id taken at micros,
+ microseconds since the epoch.  It is held in memory until the next
+ sync.  It returns 0 if OK, otherwise -1.
+
+ SPOOL_sync writes the appended samples and waits until they are on
+ disk, so a group of samples costs one fdatasync.  It returns 0 if
+ OK, otherwise -1, and the samples are kept for the next sync.
+
+ SPOOL_count returns the number of records on disk not yet consumed.
+
+ SPOOL_read fills recs with up to count of the oldest records not yet
+ consumed, sorted by time.  It returns the number read, or -1.
+
+ SPOOL_consume drops the count oldest records, i.e. those returned by
+ SPOOL_read.  It is not synced; after a crash the records may be sent
+ again.  It returns 0 if OK, otherwise -1.
+
+ SPOOL_cancel syncs and closes the spool.
+
+ */
+
+SPOOL_t *SPOOL            (const char *path);
+
+int    SPOOL_append       (SPOOL_t *spool, uint64_t micros, uint32_t id, uint64_t value);
+
+int    SPOOL_sync         (SPOOL_t *spool);
+
+int    SPOOL_count        (SPOOL_t *spool);
+
+int    SPOOL_read         (SPOOL_t *spool, SPOOL_record_t *recs, int count);
+
+int    SPOOL_consume      (SPOOL_t *spool, int count);
+
+void   SPOOL_cancel       (SPOOL_t *spool);
+
+#endif
@@ -0,0 +1,360 @@
+/*
+ bench_METER.c
+ 2016-02-10
+ Public Domain
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include <linux/perf_event.h>
+
+#include <pigpiod_if2.h>
+
+#include "METER.h"
+
+/*
+
+ Drives METER's decode path with synthetic pigpiod report batches
+ and reports the cost per pulse, cache misses and the latency of
+ each batch.  The pigpiod_if2 calls METER makes are replaced below,
+ so no Pi, daemon or library is needed.
+
+ Each pulse period is two reports, every channel's gpio high then
+ all low, spaced to give the requested pulse rate per channel.
+
+ TO BUILD
+
+ gcc -Wall -O2 -pthread -I../pigpio/PIGPIO -o bench_METER bench_METER.c METER.c
+
+ TO RUN
+
+ ./bench_METER                 # 1, 2, 4, 8, 16 and 32 channels
+
+ ./bench_METER -c8 -r50000     # 8 channels at 50 kHz each
+
+ Cache misses are read with perf_event_open and show as - where
+ that is not permitted (see /proc/sys/kernel/perf_event_paranoid).
+
+ */
+
+/* STUB PIGPIOD_IF2 ------------------------------------------------------- */
+
+static CBFuncBatch_t benchCB = NULL;
+static void *benchUser = NULL;
+
+int set_mode(int pi, unsigned gpio, unsigned mode) {return 0;}
+
+int set_pull_up_down(int pi, unsigned gpio, unsigned pud) {return 0;}
+
+int set_glitch_filter(int pi, unsigned user_gpio, unsigned steady) {return 0;}
+
+int set_watchdog(int pi, unsigned user_gpio, unsigned timeout) {return 0;}
+
+uint32_t read_bank_1(int pi) {return 0;}
+
+uint32_t get_current_tick(int pi) {return 0;}
+
+uint32_t get_notify_lost(int pi) {return 0;}
+
+int callback_batch(int pi, uint32_t bits, CBFuncBatch_t f, void *userdata)
+{
+    benchCB = f;
+    benchUser = userdata;
+    
+    return 0;
+}
+
+int callback_cancel(unsigned callback_id) {return 0;}
+
+/* BENCHMARK -------------------------------------------------------------- */
+
+void fatal(char *fmt, ...)
+{
+    char buf[128];
+    va_list ap;
+    
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    
+    fprintf(stderr, "%s\n", buf);
+    
+    fflush(stderr);
+    
+    exit(EXIT_FAILURE);
+}
+
+void usage()
+{
+    fprintf(stderr, "\n" \
+            "Usage: bench_METER [OPTION] ...\n" \
+            "   -c value, channels, 1-32 (0=sweep),      default 0\n" \
+            "   -n value, pulses per run,                default 10000000\n" \
+            "   -r value, pulses per second per channel, default 1000\n" \
+            "   -b value, reports per batch, 2-4096,     default 256\n" \
+            "   -k value, callbacks, 0=none 1=batch 2=per pulse (-c1 only), default 0\n" \
+            "EXAMPLE\n" \
+            "bench_METER -c4 -r20000\n" \
+            "   Four channels at 20 kHz each.\n\n");
+}
+
+int optChannels = 0;
+uint64_t optPulses = 10000000;
+uint32_t optRate = 1000;
+int optBatch = 256;
+int optCallbacks = 0;
+
+static uint64_t getNum(char *str, int *err)
+{
+    uint64_t val;
+    char *endptr;
+    
+    *err = 0;
+    val = strtoll(str, &endptr, 0);
+    if (*endptr) {*err = 1; val = -1;}
+    return val;
+}
+
+static void initOpts(int argc, char *argv[])
+{
+    int opt, err;
+    uint64_t i;
+    
+    while ((opt = getopt(argc, argv, "c:n:r:b:k:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                i = getNum(optarg, &err);
+                if (!err && (i <= 32)) optChannels = i;
+                else fatal("invalid -c option (%s)", optarg);
+                break;
+            
+            case 'n':
+                i = getNum(optarg, &err);
+                if (!err && (i > 0)) optPulses = i;
+                else fatal("invalid -n option (%s)", optarg);
+                break;
+            
+            case 'r':
+                i = getNum(optarg, &err);
+                if (!err && (i > 0) && (i <= 500000)) optRate = i;
+                else fatal("invalid -r option (%s)", optarg);
+                break;
+            
+            case 'b':
+                i = getNum(optarg, &err);
+                if (!err && (i >= 2) && (i <= 4096)) optBatch = i & ~1;
+                else fatal("invalid -b option (%s)", optarg);
+                break;
+            
+            case 'k':
+                i = getNum(optarg, &err);
+                if (!err && (i <= 2)) optCallbacks = i;
+                else fatal("invalid -k option (%s)", optarg);
+                break;
+            
+            default: /* '?' */
+                usage();
+                exit(-1);
+        }
+    }
+    
+    /* only a single meter takes a per pulse callback */
+    
+    if ((optCallbacks == 2) && (optChannels != 1))
+    {
+        fprintf(stderr, "-k2 needs -c1\n");
+        usage();
+        exit(-1);
+    }
+}
+
+static uint64_t sink;
+
+static void cbf(uint64_t pos, uint64_t tick) {sink += pos;}
+
+static void bcbf(uint64_t pos, const uint64_t *ticks, int count) {sink += count;}
+
+static uint64_t nanos(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    
+    return (x > y) - (x < y);
+}
+
+static int perfOpen(void)
+{
+    struct perf_event_attr attr;
+    
+    memset(&attr, 0, sizeof(attr));
+    
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void run(int channels)
+{
+    METER_t *renc, *chan;
+    gpioReport_t *reports;
+    uint64_t *lat, *ticks;
+    uint64_t pulses, misses, t0, t1, total, drained;
+    uint32_t mask, tick, half;
+    int batches, b, i, fd, n;
+    
+    mask = (channels == 32) ? 0xffffffff : (1U << channels) - 1;
+    
+    if (channels == 1) renc = METER(0, 0, 0, 0, NULL);
+    else               renc = METER_multi(0, mask, 0, 0);
+    
+    if (!renc || !benchCB) fatal("can't start meter");
+    
+    chan = (channels == 1) ? renc : METER_channel(renc, 0);
+    
+    if (optCallbacks == 1) METER_set_batch_callback(chan, bcbf);
+    
+    if (optCallbacks == 2)
+    {
+        METER_cancel(renc);
+        renc = chan = METER(0, 0, 0, 0, cbf);
+    }
+    
+    /* each batch holds optBatch/2 pulse periods */
+    
+    batches = (optPulses / channels + optBatch/2 - 1) / (optBatch/2);
+    
+    reports = malloc(optBatch * sizeof(gpioReport_t));
+    lat = malloc(batches * sizeof(uint64_t));
+    ticks = malloc(METER_RING_SIZE * sizeof(uint64_t));
+    
+    if (!reports || !lat || !ticks) fatal("out of memory");
+    
+    half = 500000 / optRate;
+    
+    if (!half) half = 1;
+    
+    fd = perfOpen();
+    
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    
+    tick = 0;
+    total = 0;
+    
+    for (b=0; b<batches; b++)
+    {
+        for (i=0; i<optBatch; i++)
+        {
+            tick += half;
+            
+            reports[i].seqno = 0;
+            reports[i].flags = 0;
+            reports[i].tick = tick;
+            reports[i].level = (i & 1) ? 0 : mask;
+        }
+        
+        t0 = nanos();
+        benchCB(0, reports, optBatch, benchUser);
+        t1 = nanos();
+        
+        lat[b] = t1 - t0;
+        total += lat[b];
+    }
+    
+    misses = 0;
+    
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) misses = 0;
+        
+        close(fd);
+    }
+    
+    /* the ring as a consumer sees it, at most METER_RING_SIZE behind */
+    
+    t0 = nanos();
+    drained = 0;
+    
+    while ((n = METER_drain(chan, ticks, METER_RING_SIZE)) > 0) drained += n;
+    
+    t1 = nanos();
+    
+    pulses = (uint64_t)batches * (optBatch/2) * channels;
+    
+    qsort(lat, batches, sizeof(uint64_t), cmp64);
+    
+    printf("%5d %11" PRIu64 " %9.1f %9.2f %9.2f %9.2f %9.2f %9.2f",
+           channels, pulses,
+           (double)total / pulses,
+           pulses * 1000.0 / total,
+           lat[batches/2] / 1000.0,
+           lat[(uint64_t)batches*99/100] / 1000.0,
+           lat[(uint64_t)batches*999/1000] / 1000.0,
+           lat[batches-1] / 1000.0);
+    
+    if (fd >= 0) printf(" %10.3f", (double)misses / pulses);
+    else         printf(" %10s", "-");
+    
+    if (drained) printf(" %9.2f\n", (double)(t1 - t0) / drained);
+    else         printf(" %9s\n", "-");
+    
+    if (METER_get_position(chan) != pulses / channels)
+        fatal("counted %" PRIu64 " of %" PRIu64 " pulses",
+              METER_get_position(chan), pulses / channels);
+    
+    METER_cancel(renc);
+    
+    benchCB = NULL;
+    
+    free(reports);
+    free(lat);
+    free(ticks);
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    
+    initOpts(argc, argv);
+    
+    printf("%d reports per batch, %" PRIu32 " pulses/s per channel\n\n",
+           optBatch, optRate);
+    
+    printf("%5s %11s %9s %9s %9s %9s %9s %9s %10s %9s\n",
+           "chans", "pulses", "ns/pulse", "Mpulse/s",
+           "p50 us", "p99 us", "p99.9 us", "max us", "miss/pulse", "drain ns");
+    
+    if (optChannels) run(optChannels);
+    else for (c=1; c<=32; c*=2) run(c);
+    
+    return 0;
+}
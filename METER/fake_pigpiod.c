@@ -0,0 +1,726 @@
+/*
+ fake_pigpiod.c
+ 2016-02-10
+ Public Domain
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <command.h>
+
+/*
+
+ A stand in for pigpiod which speaks enough of its socket protocol
+ for pigpiod_if2 and METER: the commands on the command socket,
+ PI_CMD_NOIB notification sockets and their PI_CMD_NB/NP/NC bit
+ masks, PI_CMD_BR1, PI_CMD_TICK and gpio watchdogs.  Commands it
+ does not know are acknowledged with 0.
+
+ The gpio levels come from a stream of gpioReport_t, either a
+ recording (e.g. cat /dev/pigpio0 > file after pigs no nb 0 bits)
+ replayed in a loop, or a square wave on the -g gpios.  The stream
+ starts when the first notification is begun and is replayed at -x
+ times real time, 0 as fast as the clients take it.
+
+ Like pigpiod, reports a client can't take without blocking are
+ dropped but still numbered, so the client sees a seqno gap.  Gaps,
+ bursts and disconnects can also be forced.
+
+ TO BUILD
+
+ gcc -Wall -O2 -I../pigpio/PIGPIO -o fake_pigpiod fake_pigpiod.c
+
+ TO RUN
+
+ ./fake_pigpiod -p8888 -g0x10 -r1000 -x100 &
+
+ ./METER -a4 -h localhost -p8888
+
+ */
+
+#define MAX_CLIENTS 32
+#define MAX_QUEUED  4096
+#define MAX_EMIT    4096 /* reports generated per pass of the main loop */
+
+typedef struct
+{
+    int fd;
+    int notify;         /* PI_CMD_NOIB has made this a notification socket */
+    uint32_t bits;      /* gpios reported, 0 if paused or not begun */
+    uint16_t seqno;
+    uint64_t sent;      /* reports numbered, for -d */
+    int got;            /* bytes of cmd read so far */
+    cmdCmd_t cmd;
+    uint32_t ext;       /* extension bytes still to discard */
+    int queued;
+    gpioReport_t queue[MAX_QUEUED];
+} client_t;
+
+void fatal(char *fmt, ...)
+{
+    char buf[128];
+    va_list ap;
+    
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    
+    fprintf(stderr, "%s\n", buf);
+    
+    fflush(stderr);
+    
+    exit(EXIT_FAILURE);
+}
+
+void usage()
+{
+    fprintf(stderr, "\n" \
+            "Usage: fake_pigpiod [OPTION] ...\n" \
+            "   -p value, socket port, 1024-32000,       default 8888\n" \
+            "   -f value, gpioReport_t file to replay,   default NULL\n" \
+            "   -g value, gpio mask of the square wave,  default 0x10\n" \
+            "   -r value, square wave pulses per second, default 1000\n" \
+            "   -x value, times real time (0=unpaced),   default 1\n" \
+            "   -d value, drop reports after every value, default 0 (never)\n" \
+            "   -D value, reports dropped each time,     default 1\n" \
+            "   -u value, send in bursts every value ms, default 0 (no bursts)\n" \
+            "   -k value, disconnect every value secs,   default 0 (never)\n" \
+            "   -s value, run seconds, >=0 (0=forever),  default 0\n" \
+            "EXAMPLE\n" \
+            "fake_pigpiod -g0x30 -r5000 -x100 -d10000\n" \
+            "   5 kHz on GPIO 4 and 5 at 100 times real time,\n" \
+            "   dropping a report after every 10000.\n\n");
+}
+
+char *optPort = "8888";
+char *optFile = NULL;
+uint32_t optGpios = 0x10;
+uint32_t optRate = 1000;
+double optSpeed = 1.0;
+uint64_t optDropEvery = 0;
+uint64_t optDropCount = 1;
+uint32_t optBurst = 0;
+uint32_t optDisconnect = 0;
+uint32_t optSeconds = 0;
+
+static uint64_t getNum(char *str, int *err)
+{
+    uint64_t val;
+    char *endptr;
+    
+    *err = 0;
+    val = strtoll(str, &endptr, 0);
+    if (*endptr) {*err = 1; val = -1;}
+    return val;
+}
+
+static void initOpts(int argc, char *argv[])
+{
+    int opt, err;
+    uint64_t i;
+    
+    while ((opt = getopt(argc, argv, "p:f:g:r:x:d:D:u:k:s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'p':
+                optPort = optarg;
+                break;
+            
+            case 'f':
+                optFile = optarg;
+                break;
+            
+            case 'g':
+                i = getNum(optarg, &err);
+                if (!err && i && (i <= 0xffffffff)) optGpios = i;
+                else fatal("invalid -g option (%s)", optarg);
+                break;
+            
+            case 'r':
+                i = getNum(optarg, &err);
+                if (!err && (i > 0) && (i <= 500000)) optRate = i;
+                else fatal("invalid -r option (%s)", optarg);
+                break;
+            
+            case 'x':
+                optSpeed = atof(optarg);
+                if (optSpeed < 0.0) fatal("invalid -x option (%s)", optarg);
+                break;
+            
+            case 'd':
+                i = getNum(optarg, &err);
+                if (!err) optDropEvery = i;
+                else fatal("invalid -d option (%s)", optarg);
+                break;
+            
+            case 'D':
+                i = getNum(optarg, &err);
+                if (!err && (i > 0)) optDropCount = i;
+                else fatal("invalid -D option (%s)", optarg);
+                break;
+            
+            case 'u':
+                i = getNum(optarg, &err);
+                if (!err) optBurst = i;
+                else fatal("invalid -u option (%s)", optarg);
+                break;
+            
+            case 'k':
+                i = getNum(optarg, &err);
+                if (!err) optDisconnect = i;
+                else fatal("invalid -k option (%s)", optarg);
+                break;
+            
+            case 's':
+                i = getNum(optarg, &err);
+                if (!err) optSeconds = i;
+                else fatal("invalid -s option (%s)", optarg);
+                break;
+            
+            default: /* '?' */
+                usage();
+                exit(-1);
+        }
+    }
+}
+
+/* STATE ------------------------------------------------------------------ */
+
+client_t *gClient[MAX_CLIENTS];
+
+FILE *gFile = NULL;
+
+int gStarted = 0;          /* the stream has begun */
+uint64_t gWallStart;       /* host micros when it began */
+uint64_t gStreamStart;     /* stream tick when it began */
+uint64_t gStreamTick;      /* stream tick of the last report generated */
+uint64_t gLastBurst;
+uint64_t gLastDisconnect;
+
+uint32_t gLevel = 0;       /* gpio levels after the last report */
+uint32_t gWatchdog[32];    /* milliseconds, 0 if off */
+uint64_t gQuiet[32];       /* stream tick of each gpio's last change or watchdog */
+
+int gHave = 0;             /* a report is waiting in gNext */
+gpioReport_t gNext;
+uint64_t gNextTick;
+
+uint64_t gDropped = 0;
+uint64_t gEmitted = 0;
+
+static uint64_t micros(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* the current stream tick, the host clock before the stream begins */
+
+static uint64_t nowTick(void)
+{
+    if (!gStarted) return micros();
+    
+    if (optSpeed == 0.0) return gStreamTick;
+    
+    return gStreamStart + (uint64_t)((micros() - gWallStart) * optSpeed);
+}
+
+/* SOURCE ----------------------------------------------------------------- */
+
+/*
+ Produces the next report of the stream into gNext.  Recorded ticks
+ are 32 bit, so they are widened like METER does; each replay of the
+ file follows on one millisecond after the previous one ended.
+ */
+
+static void nextReport(void)
+{
+    static uint32_t lastFileTick;
+    static int haveFileTick = 0;
+    static uint64_t half = 0;
+    static int high = 0;
+    gpioReport_t r;
+    
+    if (gFile)
+    {
+        if (fread(&r, sizeof(r), 1, gFile) != 1)
+        {
+            rewind(gFile);
+            
+            if (fread(&r, sizeof(r), 1, gFile) != 1)
+                fatal("%s holds no reports", optFile);
+            
+            haveFileTick = 0;
+            gNextTick += 1000;
+        }
+        
+        if (haveFileTick) gNextTick += (uint32_t)(r.tick - lastFileTick);
+        
+        lastFileTick = r.tick;
+        haveFileTick = 1;
+        
+        /* watchdog reports are made here, according to PI_CMD_WDOG */
+        
+        if (r.flags & PI_NTFY_FLAGS_WDOG) r.flags = 0;
+        
+        gNext = r;
+    }
+    else
+    {
+        if (!half) half = (optRate > 500000) ? 1 : 500000 / optRate;
+        
+        high = !high;
+        
+        gNextTick += half;
+        
+        gNext.flags = 0;
+        gNext.level = high ? optGpios : 0;
+    }
+    
+    gNext.tick = gNextTick;
+    gHave = 1;
+}
+
+/* NOTIFY ----------------------------------------------------------------- */
+
+static void closeClient(int c)
+{
+    close(gClient[c]->fd);
+    free(gClient[c]);
+    gClient[c] = NULL;
+}
+
+static void flushClient(int c, int drop)
+{
+    client_t *cl = gClient[c];
+    ssize_t n;
+    size_t bytes;
+    
+    if (!cl->queued) return;
+    
+    bytes = cl->queued * sizeof(gpioReport_t);
+    
+    n = write(cl->fd, cl->queue, bytes);
+    
+    if (n < 0)
+    {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        {
+            /* as pigpiod does, the client sees a gap in seqno */
+            
+            if (drop)
+            {
+                gDropped += cl->queued;
+                cl->queued = 0;
+            }
+        }
+        else closeClient(c);
+        
+        return;
+    }
+    
+    /* never leave a partial report behind */
+    
+    while (n % sizeof(gpioReport_t))
+    {
+        if (write(cl->fd, (char *)cl->queue + n, 1) == 1) n++;
+        else if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) break;
+    }
+    
+    n /= sizeof(gpioReport_t);
+    
+    memmove(cl->queue, cl->queue + n, (cl->queued - n) * sizeof(gpioReport_t));
+    
+    cl->queued -= n;
+}
+
+static void emit(gpioReport_t *r, uint32_t changed)
+{
+    client_t *cl;
+    int c, g;
+    
+    for (c=0; c<MAX_CLIENTS; c++)
+    {
+        cl = gClient[c];
+        
+        if (!cl || !cl->notify || !cl->bits) continue;
+        
+        if (r->flags)
+        {
+            g = r->flags & 31;
+            if (!(cl->bits & (1<<g))) continue;
+        }
+        else if (!(changed & cl->bits)) continue;
+        
+        r->seqno = cl->seqno++;
+        
+        cl->sent++;
+        
+        if (optDropEvery && ((cl->sent % (optDropEvery + optDropCount)) >= optDropEvery))
+        {
+            gDropped++;
+            continue;
+        }
+        
+        if (cl->queued == MAX_QUEUED) flushClient(c, 1);
+        
+        if (!gClient[c]) continue;
+        
+        if (cl->queued == MAX_QUEUED) gDropped++;
+        else cl->queue[cl->queued++] = *r;
+    }
+    
+    gEmitted++;
+}
+
+/*
+ Report any watchdog which expires before tick.  Like pigpiod, a
+ watchdog is reported again every timeout while the gpio stays quiet.
+ */
+
+static void watchdogs(uint64_t tick)
+{
+    gpioReport_t r;
+    uint64_t expiry;
+    int g;
+    
+    for (g=0; g<32; g++)
+    {
+        if (!gWatchdog[g]) continue;
+        
+        while ((expiry = gQuiet[g] + gWatchdog[g] * 1000ULL) <= tick)
+        {
+            gQuiet[g] = expiry;
+            
+            r.flags = PI_NTFY_FLAGS_WDOG | PI_NTFY_FLAGS_BIT(g);
+            r.tick = expiry;
+            r.level = gLevel;
+            
+            emit(&r, 0);
+        }
+    }
+}
+
+static void stream(void)
+{
+    uint64_t target;
+    uint32_t changed;
+    int n, c, g;
+    
+    if (!gStarted) return;
+    
+    if (optSpeed == 0.0)
+    {
+        /* unpaced, wait until every client has taken what it was sent */
+        
+        for (c=0; c<MAX_CLIENTS; c++)
+        {
+            if (gClient[c] && gClient[c]->notify) flushClient(c, 0);
+            
+            if (gClient[c] && gClient[c]->queued) return;
+        }
+        
+        target = UINT64_MAX;
+    }
+    else target = nowTick();
+    
+    for (n=0; n<MAX_EMIT; n++)
+    {
+        if (!gHave) nextReport();
+        
+        if (gNextTick > target) break;
+        
+        watchdogs(gNextTick);
+        
+        changed = gNext.level ^ gLevel;
+        
+        gLevel = gNext.level;
+        gStreamTick = gNextTick;
+        
+        for (g=0; g<32; g++)
+        {
+            if (changed & (1<<g)) gQuiet[g] = gNextTick;
+        }
+        
+        emit(&gNext, changed);
+        
+        gHave = 0;
+    }
+    
+    if (optSpeed != 0.0) watchdogs(target);
+    else target = gStreamTick;
+    
+    /* with -u the reports are held back and sent together */
+    
+    if (optBurst && (target - gLastBurst < optBurst * 1000ULL)) return;
+    
+    gLastBurst = target;
+    
+    for (c=0; c<MAX_CLIENTS; c++)
+    {
+        if (gClient[c] && gClient[c]->notify) flushClient(c, optSpeed != 0.0);
+    }
+}
+
+/* COMMANDS --------------------------------------------------------------- */
+
+static void command(int c)
+{
+    client_t *cl = gClient[c];
+    cmdCmd_t *cmd = &cl->cmd;
+    client_t *nc;
+    uint32_t res = 0;
+    int h;
+    
+    switch (cmd->cmd)
+    {
+        case PI_CMD_NOIB:
+            cl->notify = 1;
+            res = c; /* the handle is the client slot */
+            break;
+        
+        case PI_CMD_NB:
+        case PI_CMD_NP:
+        case PI_CMD_NC:
+            h = cmd->p1;
+            nc = ((h >= 0) && (h < MAX_CLIENTS)) ? gClient[h] : NULL;
+            
+            if (!nc || !nc->notify)
+            {
+                res = PI_BAD_HANDLE;
+                break;
+            }
+            
+            if (cmd->cmd == PI_CMD_NB)
+            {
+                nc->bits = cmd->p2;
+                
+                if (!gStarted && nc->bits)
+                {
+                    gStarted = 1;
+                    gWallStart = micros();
+                    gStreamStart = gStreamTick = gNextTick = gLastBurst = gWallStart;
+                    gLastDisconnect = gWallStart;
+                    
+                    for (h=0; h<32; h++) gQuiet[h] = gWallStart;
+                }
+            }
+            else if (cmd->cmd == PI_CMD_NP) nc->bits = 0;
+            else closeClient(h);
+            break;
+        
+        case PI_CMD_BR1:
+            res = gLevel;
+            break;
+        
+        case PI_CMD_TICK:
+            res = (uint32_t)nowTick();
+            break;
+        
+        case PI_CMD_WDOG:
+            if (cmd->p1 < 32)
+            {
+                gWatchdog[cmd->p1] = cmd->p2;
+                gQuiet[cmd->p1] = nowTick();
+            }
+            else res = PI_BAD_USER_GPIO;
+            break;
+        
+        case PI_CMD_HWVER:
+            res = 0xa02082; /* Pi 3B */
+            break;
+        
+        case PI_CMD_PIGPV:
+            res = PIGPIO_VERSION;
+            break;
+        
+        default:
+            res = 0;
+    }
+    
+    cmd->res = res;
+    
+    if (gClient[c] && (write(cl->fd, cmd, sizeof(*cmd)) != sizeof(*cmd)))
+        closeClient(c);
+}
+
+static void readClient(int c)
+{
+    client_t *cl = gClient[c];
+    char discard[256];
+    ssize_t n;
+    
+    if (cl->ext)
+    {
+        n = read(cl->fd, discard,
+                 cl->ext < sizeof(discard) ? cl->ext : sizeof(discard));
+        
+        if (n <= 0)
+        {
+            if ((n < 0) && (errno == EAGAIN)) return;
+            closeClient(c);
+            return;
+        }
+        
+        cl->ext -= n;
+        
+        if (!cl->ext) command(c);
+        
+        return;
+    }
+    
+    n = read(cl->fd, (char *)&cl->cmd + cl->got, sizeof(cl->cmd) - cl->got);
+    
+    if (n <= 0)
+    {
+        if ((n < 0) && (errno == EAGAIN)) return;
+        closeClient(c);
+        return;
+    }
+    
+    cl->got += n;
+    
+    if (cl->got < sizeof(cl->cmd)) return;
+    
+    cl->got = 0;
+    
+    /* extended commands are followed by p3 bytes, which are ignored */
+    
+    if (!cl->notify && cl->cmd.p3 && (cl->cmd.cmd != PI_CMD_NOIB))
+    {
+        cl->ext = cl->cmd.p3;
+        return;
+    }
+    
+    command(c);
+}
+
+static void acceptClient(int sock)
+{
+    client_t *cl;
+    int fd, c, one = 1;
+    
+    fd = accept(sock, NULL, NULL);
+    
+    if (fd < 0) return;
+    
+    for (c=0; c<MAX_CLIENTS; c++) if (!gClient[c]) break;
+    
+    if ((c == MAX_CLIENTS) || !(cl = calloc(1, sizeof(client_t))))
+    {
+        close(fd);
+        return;
+    }
+    
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    cl->fd = fd;
+    gClient[c] = cl;
+}
+
+static int openListener(void)
+{
+    struct sockaddr_in addr;
+    int sock, one = 1;
+    
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    if (sock < 0) fatal("can't create socket");
+    
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    
+    memset(&addr, 0, sizeof(addr));
+    
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(atoi(optPort));
+    
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        fatal("can't bind port %s", optPort);
+    
+    if (listen(sock, MAX_CLIENTS) < 0) fatal("can't listen");
+    
+    return sock;
+}
+
+int main(int argc, char *argv[])
+{
+    struct pollfd fds[MAX_CLIENTS+1];
+    int idx[MAX_CLIENTS+1];
+    uint64_t begin, now;
+    int sock, nfds, c, i;
+    
+    initOpts(argc, argv);
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    if (optFile && !(gFile = fopen(optFile, "rb")))
+        fatal("can't open %s", optFile);
+    
+    sock = openListener();
+    
+    begin = micros();
+    
+    while (!optSeconds || ((micros() - begin) < optSeconds * 1000000ULL))
+    {
+        fds[0].fd = sock;
+        fds[0].events = POLLIN;
+        nfds = 1;
+        
+        for (c=0; c<MAX_CLIENTS; c++)
+        {
+            if (!gClient[c]) continue;
+            
+            fds[nfds].fd = gClient[c]->fd;
+            fds[nfds].events = POLLIN;
+            idx[nfds++] = c;
+        }
+        
+        poll(fds, nfds, (gStarted && (optSpeed == 0.0)) ? 0 : 1);
+        
+        if (fds[0].revents & POLLIN) acceptClient(sock);
+        
+        for (i=1; i<nfds; i++)
+        {
+            if (fds[i].revents && gClient[idx[i]]) readClient(idx[i]);
+        }
+        
+        stream();
+        
+        now = micros();
+        
+        if (gStarted && optDisconnect &&
+            ((now - gLastDisconnect) >= optDisconnect * 1000000ULL))
+        {
+            gLastDisconnect = now;
+            
+            fprintf(stderr, "disconnecting all clients\n");
+            
+            for (c=0; c<MAX_CLIENTS; c++) if (gClient[c]) closeClient(c);
+        }
+    }
+    
+    fprintf(stderr, "%" PRIu64 " reports, %" PRIu64 " dropped\n",
+            gEmitted, gDropped);
+    
+    return 0;
+}
@@ -8,15 +8,25 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <inttypes.h>
 #include <unistd.h>
-#include <sys/time.h>
-
-#include <netdb.h>
-#include <netinet/in.h>
-
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#ifdef METER_LIBPIGPIO
+#include <pigpio.h>
+#else
 #include <pigpiod_if2.h>
+#endif
 
 #include "METER.h"
+#include "RRDC.h"
+#include "SPOOL.h"
+#include "DBS.h"
 
 #include <rrd.h>
 
@@ -29,7 +39,11 @@
  
  TO BUILD
  
- gcc -Wall -pthread -o METER test_METER.c METER.c -lpigpiod_if2
+ gcc -Wall -pthread -o METER test_METER.c METER.c RRDC.c SPOOL.c DBS.c -lpigpiod_if2 -lrrd -lsqlite3
+ 
+ or, to count in process without pigpiod (run as root, -h/-p unused)
+ 
+ gcc -Wall -pthread -DMETER_LIBPIGPIO -o METER test_METER.c METER.c RRDC.c SPOOL.c DBS.c -lpigpio -lrt -lrrd -lsqlite3
  
  TO RUN
  
@@ -64,50 +78,50 @@ void usage()
     fprintf(stderr, "\n" \
             "Usage: METER [OPTION] ...\n" \
             "   -a value, gpio A, 0-31,                  default None\n" \
-            "   -v value, startValue, uint32,            default 0\n" \
-            "   -g value, glitch filter setting, 0-5000, default 1\n" \
+            "   -v value, startValue, uint64,            default 0\n" \
+            "   -c value, counter state file             default NULL\n"\
+            "   -g value, glitch filter setting, 0-5000, default 0\n" \
+            "   -i value, min micros between pulses,     default 0\n" \
+            "   -w value, idle watchdog millis, 0-60000, default 0\n" \
             "   -s value, run seconds, >=0 (0=forever),  default 0\n" \
             "   -t value, seconds between rrd-writes     default 60\n"\
             "   -f value, rrd file to write to           default NULL\n"\
             "   -d value, seconds between db-writes      default 3600\n"\
-            "   -m mysql-connection-string               default NULL\n"\
+            "   -m value, sqlite database file           default NULL\n"\
             "   -h string, host name,                    default NULL\n" \
             "   -p value, socket port, 1024-32000,       default 8888\n" \
             "   -r string, rrd server host name,                    default NULL\n" \
             "   -b value, rrd socket port, 1024-32000,       default 13900\n" \
+            "   -q value, rrd socket spool file          default NULL\n"\
             "EXAMPLE\n" \
             "METER -a10 -b12\n" \
             "   Read a rotary encoder connected to GPIO 10/12.\n\n");
 }
 
 int optGpio = -1;
-int optGlitch = 1;
-uint32_t optStartMeterValue=0;
+int optGlitch = 0;
+uint32_t optMinInterval = 0;
+int optWatchdog = 0;
+uint64_t optStartMeterValue=0;
 int optSeconds = 0;
 int optRRDSeconds = 60;
 int optDBSeconds = 3600;
 char *optRRDFile = NULL;
-char *optMyConnectionString = NULL;
+char *optStateFile = NULL;
+char *optDBFile = NULL;
 char *optHost   = NULL;
 char *optPort   = "8888";
 char *optRRDHost   = NULL;
 char *optRRDPort   = "13900";
+char *optSpoolFile = NULL;
 
 
 
-int sockfd=-1;
-int n;
-struct sockaddr_in serv_addr;
-struct hostent *server;
+int epfd=-1;
 
-int64_t lastRRDTick =0;
-int64_t lastDBTick =0;
+void write_db(uint64_t value);
 
-struct timeval te;
-
-void write_db(uint32_t value);
-
-uint32_t currentMeterValue;
+DBS_t *dbs = NULL;
 
 
 
@@ -128,7 +142,7 @@ static void initOpts(int argc, char *argv[])
 {
     int opt, err, i;
     
-    while ((opt = getopt(argc, argv, "a:b:r:v:f:g:t:d:m:s:h:p:")) != -1)
+    while ((opt = getopt(argc, argv, "a:b:c:r:v:f:g:i:w:t:d:m:s:h:p:q:")) != -1)
     {
         switch (opt)
         {
@@ -148,6 +162,18 @@ static void initOpts(int argc, char *argv[])
                 else fatal("invalid -g option (%s)", optarg);
                 break;
                 
+            case 'i':
+                i = getNum(optarg, &err);
+                if (i >= 0) optMinInterval = i;
+                else fatal("invalid -i option (%s)", optarg);
+                break;
+                
+            case 'w':
+                i = getNum(optarg, &err);
+                if ((i >= 0) && (i <= 60000)) optWatchdog = i;
+                else fatal("invalid -w option (%s)", optarg);
+                break;
+                
             case 's':
                 i = getNum(optarg, &err);
                 if (i >= 0) optSeconds = (i*1000);
@@ -165,8 +191,12 @@ static void initOpts(int argc, char *argv[])
                 break;
 
             case 'm':
-                optMyConnectionString = malloc(strlen(optarg) + 1);
-                if (optMyConnectionString) strcpy(optMyConnectionString, optarg);
+                optDBFile = malloc(strlen(optarg) + 1);
+                if (optDBFile) strcpy(optDBFile, optarg);
+                break;
+            case 'c':
+                optStateFile = malloc(strlen(optarg) +1);
+                if (optStateFile) strcpy(optStateFile, optarg);
                 break;
             case 'f':
                 optRRDFile = malloc(strlen(optarg) +1);
@@ -192,6 +222,11 @@ static void initOpts(int argc, char *argv[])
                 if (optRRDPort) strcpy(optRRDPort, optarg);
                 break;
 
+            case 'q':
+                optSpoolFile = malloc(strlen(optarg)+1);
+                if (optSpoolFile) strcpy(optSpoolFile, optarg);
+                break;
+
             default: /* '?' */
                 usage();
                 exit(-1);
@@ -199,10 +234,38 @@ static void initOpts(int argc, char *argv[])
     }
 }
 
-void write_rrd(uint32_t pos){
+/*
+ RRD updates are stamped with the wall clock time of the pulse which
+ gave the count, unless no pulse has arrived since the last update,
+ when the count still holds now (N).  Then the last stamp is now, so
+ a later pulse time rrd would take as earlier is not used.
+ */
+
+struct timespec lastRRDStamp;
+
+void rrd_stamp(char *buf, const struct timespec *ts)
+{
+    if (!ts || (ts->tv_sec < lastRRDStamp.tv_sec) ||
+        ((ts->tv_sec == lastRRDStamp.tv_sec) &&
+         (ts->tv_nsec / 1000000 <= lastRRDStamp.tv_nsec / 1000000)))
+    {
+        strcpy(buf, "N");
+        clock_gettime(CLOCK_REALTIME, &lastRRDStamp);
+        return;
+    }
+    
+    sprintf(buf, "%lld.%03ld", (long long)ts->tv_sec, ts->tv_nsec / 1000000);
+    
+    lastRRDStamp = *ts;
+}
+
+void write_rrd(uint64_t pos, const struct timespec *ts){
+    
+    char stamp[32];
+    rrd_stamp(stamp, ts);
     
     char *str = malloc(sizeof(char) * 1024);
-    sprintf(str, "N:%d", pos);
+    sprintf(str, "%s:%" PRIu64, stamp, pos);
     char *data=malloc(strlen(str)+1);
     strcpy(data,str);
     
@@ -217,125 +280,218 @@ void write_rrd(uint32_t pos){
     rrd_clear_error();
     rrd_update(3, updateparams);
     
-    printf("writing %d to rdd\n",pos);
+    printf("writing %" PRIu64 " to rdd\n",pos);
     
 }
 
-int getSocketNew(){
+/*
+ Updates for rrdcached are queued with the client and sent together
+ in BATCH mode; its replies are read from the main loop.  While the
+ daemon is unreachable the updates stay queued and the flush returns
+ at once.
+ */
 
-    int portno = atoi(optRRDPort);
+RRDC_t *rrdc = NULL;
+int rrdcPolled = -1;
+unsigned rrdcChanges = 0;
+int rrdcEvents = 0;
 
-    /* Create a socket point */
-    int newsockfd = socket(AF_INET, SOCK_STREAM, 0);
+void rrdcPoll(){
 
+    struct epoll_event ev;
+    int fd = RRDC_fd(rrdc);
+    unsigned changes = RRDC_fd_changes(rrdc);
 
+    ev.events = EPOLLIN | (RRDC_want_write(rrdc) ? EPOLLOUT : 0);
+    ev.data.fd = fd;
 
-    if (newsockfd < 0) {
-        printf("ERROR opening socket\n");
-        return-1;
+    if ((fd != rrdcPolled) || (changes != rrdcChanges)) {
+        /* a new descriptor may reuse the number of a closed one */
+        if (rrdcPolled >= 0) epoll_ctl(epfd, EPOLL_CTL_DEL, rrdcPolled, NULL);
+        rrdcPolled = fd;
+        rrdcChanges = changes;
+        if (fd >= 0) epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
     }
-
-    server = gethostbyname(optRRDHost);
-
-    if (server == NULL) {
-        printf("ERROR, no such host\n");
-        return -1;
+    else if ((fd >= 0) && (ev.events != rrdcEvents)) {
+        if ((epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0) && (errno == ENOENT))
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
     }
 
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
-    serv_addr.sin_port = htons(portno);
+    rrdcEvents = ev.events;
+}
 
-    printf("trying to connect to server %s:%d\n", optRRDHost, portno);
+/*
+ With a spool (-q) each update is appended to the spool file and
+ synced before anything is sent.  The oldest spooled updates are
+ sent as one batch whenever none is in flight, and dropped from the
+ spool once rrdcached answers it, so updates made while it is down,
+ or before a restart, follow when it is back.  Meter id 0 is the rrd
+ file.
+ */
 
-    /* Now connect to the server */
-    if (connect(newsockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        printf("ERROR connecting");
-        close(newsockfd);
-        return -1;
-    }
+#define SPOOL_BATCH 4096
 
-    printf("connected\n");
-    return newsockfd;
-}
+SPOOL_t *spool = NULL;
+SPOOL_record_t spoolRecs[SPOOL_BATCH];
+int spoolSent = 0;          /* records in the batch in flight */
+unsigned spoolAnswer = 0;   /* answered count once it is answered */
+unsigned spoolLost = 0;     /* lost count when it was sent */
 
-void initSocket() {
+void spoolSend(){
 
+    char values[64];
+    uint64_t us;
+    int n, i;
 
-    if (sockfd < 0) {
-        sockfd=getSocketNew();
+    if (spoolSent && (RRDC_get_lost(rrdc) != spoolLost)) {
+        /* a batch in flight was lost with the connection, resend */
+        spoolSent = 0;
+    }
+    else if (spoolSent && ((int)(RRDC_get_answered(rrdc) - spoolAnswer) >= 0)) {
+        SPOOL_consume(spool, spoolSent);
+        spoolSent = 0;
     }
 
-    int error = 0;
-    socklen_t len = sizeof (error);
-    int retval = getsockopt (sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if (spoolSent || !SPOOL_count(spool)) return;
 
-    if (retval != 0) {
-        /* there was a problem getting the error code */
-        fprintf(stderr, "error getting socket error code: %s\n", strerror(retval));
-        return;
-    }
+    if (RRDC_connect(rrdc) < 0) return;
+
+    n = SPOOL_read(spool, spoolRecs, SPOOL_BATCH);
 
-    if (error != 0) {
-        /* socket has a non zero error status */
-        fprintf(stderr, "socket error: %s\n", strerror(error));
-        close(sockfd);
-        sockfd=getSocketNew();
+    for (i=0; i<n; i++) {
+        us = spoolRecs[i].micros;
+        sprintf(values, "%" PRIu64 ".%03" PRIu64 ":%" PRIu64,
+           us / 1000000, (us / 1000) % 1000, spoolRecs[i].value);
+        RRDC_update(rrdc, optRRDFile, values);
     }
 
+    if ((n > 0) && (RRDC_flush(rrdc) == 0)) {
+        spoolSent = n;
+        spoolAnswer = RRDC_get_answered(rrdc) + 1;
+        spoolLost = RRDC_get_lost(rrdc);
+        if (n > 1) printf("replaying %d spooled updates\n", n);
+    }
 }
 
-void write_rrd_socket(uint32_t pos){
-
-    printf("start writing rdd\n");
-    fflush(stdout);
+void write_rrd_socket(uint64_t pos, const struct timespec *ts){
+
+    char values[64];
+    char stamp[32];
+    struct timespec now;
+    rrd_stamp(stamp, ts);
+
+    /*
+     A queued or spooled update may be sent long after, when N would be
+     the time rrdcached gets it, so it is given the time now.
+     */
+    if (stamp[0] == 'N') {
+        clock_gettime(CLOCK_REALTIME, &now);
+        ts = &now;
+        sprintf(stamp, "%lld.%03ld", (long long)ts->tv_sec, ts->tv_nsec / 1000000);
+    }
 
-    char *str = malloc(sizeof(char) * 1024);
-    sprintf(str, "update %s N:%d\n", optRRDFile, pos);
-    char *data=malloc(strlen(str)+1);
-    strcpy(data,str);
+    sprintf(values, "%s:%" PRIu64, stamp, pos);
 
-    char buffer[256];
-    initSocket();
-    /* Send message to the server */
-    n=write(sockfd, data, strlen(data));
+    if (!rrdc) rrdc = RRDC(optRRDHost, optRRDPort);
+    if (!rrdc) return;
 
-    if (n < 0) {
-        printf("ERROR writing to socket");
-        close(sockfd);
+    if (spool) {
+        SPOOL_append(spool, (uint64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000, 0, pos);
+        SPOOL_sync(spool);
+        spoolSend();
+        printf("spooling %" PRIu64 " for rrdcached\n", pos);
+        rrdcPoll();
         return;
     }
 
-    /* Now read server response */
-    bzero(buffer,256);
-    n = read(sockfd, buffer, 255);
-
-    if (n < 0) {
-        printf("ERROR reading from socket");
-        close(sockfd);
-        return;
-    }
+    RRDC_update(rrdc, optRRDFile, values);
 
+    if (RRDC_flush(rrdc) == 0)
+        printf("writing %" PRIu64 " to rrdcached\n", pos);
+    else
+        printf("queueing %" PRIu64 " for rrdcached\n", pos);
 
-    printf("%s",buffer);
-    fflush(stdout);
-    return;
+    rrdcPoll();
+}
 
+void evf(int event, uint64_t pos, uint64_t tick)
+{
+    if (event == METER_EVENT_IDLE)
+        printf("idle at %" PRIu64 " @ %" PRIu64 "\n", pos, tick);
+    else if (event == METER_EVENT_LOST)
+        fprintf(stderr, "reports lost before %" PRIu64 " @ %" PRIu64 "\n",
+           pos, tick);
 }
 
+/*
+ Flushes are timerfd deadlines on whole multiples of their period in
+ wall clock time, e.g. every minute on the minute.  Each is re-armed
+ from the clock when it fires, and a clock step cancels the deadline
+ so it is re-armed from the new time.  timerNext returns -1 if the
+ timer was cancelled rather than due.
+ */
 
+int timerNext(int fd, int seconds)
+{
+    struct itimerspec its;
+    struct timespec now;
+    uint64_t expiries;
+    int err = 0;
+    
+    if ((read(fd, &expiries, sizeof(expiries)) < 0) && (errno == ECANCELED))
+        err = -1;
+    
+    clock_gettime(CLOCK_REALTIME, &now);
+    
+    memset(&its, 0, sizeof(its));
+    
+    its.it_value.tv_sec = (now.tv_sec / seconds + 1) * seconds;
+    
+    timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+    
+    return err;
+}
 
-void cbf(uint32_t pos, uint32_t tick)
+int timerAligned(int seconds)
 {
-    currentMeterValue=pos;
-    printf("%1d @ %2d\n", pos,tick);
+    struct epoll_event ev;
+    int fd;
+    
+    fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    
+    if (fd < 0) fatal("can't create timer");
+    
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) fatal("can't poll timer");
+    
+    timerNext(fd, seconds);
+    
+    return fd;
+}
+
+void pollAdd(int fd)
+{
+    struct epoll_event ev;
+    
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) fatal("can't poll fd %d", fd);
 }
 
 int main(int argc, char *argv[])
 {
-    int pi;
+    int pi, meterfd, sigfd, rrdfd, dbfd, runfd, i, nev;
     METER_t *renc;
+    METER_snapshot_t snap;
+    struct timespec ts, *pulseTime;
+    struct epoll_event events[8];
+    struct itimerspec its;
+    uint64_t count;
+    sigset_t mask;
+    int running;
     
     initOpts(argc, argv);
     
@@ -345,43 +501,195 @@ int main(int argc, char *argv[])
         exit(0);
     }
     
+    /*
+     SIGINT and SIGTERM end the loop.  They are blocked before any
+     thread is started, so every thread inherits the mask and the
+     signals can only be taken from the signalfd.
+     */
+    
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    
+#ifdef METER_LIBPIGPIO
+    pi = gpioInitialise(); /* Start the library in process. */
+#else
     pi = pigpio_start(optHost, optPort); /* Connect to Pi. */
+#endif
     
     if (pi >= 0)
     {
-        renc = METER(pi, optGpio, optStartMeterValue, optGlitch, cbf);
+        /* pulses are printed from the loop, not the notify thread */
+        
+        renc = METER(pi, optGpio, optStartMeterValue, optMinInterval, NULL);
+        
+        if (optGlitch) METER_set_glitch_filter(renc, optGlitch);
+        
+        METER_set_event_callback(renc, evf);
+        
+        if (optWatchdog) METER_set_watchdog(renc, optWatchdog);
+        
+        if (optStateFile && (METER_set_state_file(renc, optStateFile) < 0))
+            fatal("can't use state file %s", optStateFile);
+        
+        if (optStateFile && !METER_get_state_time(renc, NULL, &ts))
+            printf("restored %" PRIu64 " last updated at %lld\n",
+               METER_get_position(renc), (long long)ts.tv_sec);
+        
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        
+        if (epfd < 0) fatal("can't create epoll");
+        
+        meterfd = METER_get_fd(renc);
+        
+        if (meterfd < 0) fatal("can't get meter fd");
+        
+        pollAdd(meterfd);
+        
+        sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        
+        if (sigfd < 0) fatal("can't create signalfd");
+        
+        pollAdd(sigfd);
+        
+        rrdfd = dbfd = runfd = -1;
+        
+        if (optSpoolFile && optRRDHost)
+        {
+            spool = SPOOL(optSpoolFile);
+            
+            if (!spool) fatal("can't open spool %s", optSpoolFile);
+        }
+        
+        if (optRRDFile && optRRDSeconds)
+        {
+            rrdfd = timerAligned(optRRDSeconds);
+        }
+        
+        if (optDBFile && optDBSeconds)
+        {
+            dbs = DBS(optDBFile);
+            
+            if (!dbs) fatal("can't open database %s", optDBFile);
+            
+            dbfd = timerAligned(optDBSeconds);
+        }
         
-        if (optSeconds) sleep(optSeconds);
-        else while(1) {
-            sleep(optRRDSeconds+5);
-            gettimeofday(&te, NULL);
-            int64_t tick_sec = te.tv_sec;
-
-            int64_t rrdTickDiff = tick_sec - lastRRDTick;
-            if (tick_sec < lastRRDTick || (rrdTickDiff) > optRRDSeconds){
-                write_rrd_socket(currentMeterValue);
-                lastRRDTick = tick_sec;
+        if (optSeconds)
+        {
+            runfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            
+            if (runfd < 0) fatal("can't create timer");
+            
+            memset(&its, 0, sizeof(its));
+            its.it_value.tv_sec = optSeconds / 1000;
+            its.it_value.tv_nsec = (optSeconds % 1000) * 1000000;
+            
+            timerfd_settime(runfd, 0, &its, NULL);
+            
+            pollAdd(runfd);
+        }
+        
+        METER_clock_update(renc);
+        
+        running = 1;
+        
+        while (running)
+        {
+            nev = epoll_wait(epfd, events, 8, rrdc ? RRDC_timeout(rrdc) : -1);
+            
+            if ((nev == 0) && rrdc)
+            {
+                /* a connect timed out or a retry is due */
+                
+                RRDC_io(rrdc, 0, 0);
+                if (spool) spoolSend();
+                rrdcPoll();
             }
-
-            int64_t dbTickDiff = tick_sec - lastDBTick;
-            if (tick_sec < lastDBTick || (dbTickDiff) > optDBSeconds){
-                write_db(currentMeterValue);
-                lastDBTick = tick_sec;
+            
+            for (i=0; i<nev; i++)
+            {
+                int fd = events[i].data.fd;
+                
+                if (fd == meterfd)
+                {
+                    if (read(meterfd, &count, sizeof(count)) == sizeof(count))
+                    {
+                        METER_get_snapshot(renc, &snap);
+                        printf("%1" PRIu64 " @ %2" PRIu64 "\n", snap.value, snap.tick);
+                    }
+                }
+                else if ((fd == sigfd) || (fd == runfd))
+                {
+                    running = 0;
+                }
+                else if (fd == rrdfd)
+                {
+                    if (timerNext(rrdfd, optRRDSeconds) < 0) continue;
+                    
+                    METER_sync(renc);
+                    
+                    METER_clock_update(renc);
+                    METER_get_snapshot(renc, &snap);
+                    pulseTime = (snap.tick && !METER_tick_to_time(renc, snap.tick, &ts)) ? &ts : NULL;
+                    
+                    if (optRRDHost) write_rrd_socket(snap.value, pulseTime);
+                    else            write_rrd(snap.value, pulseTime);
+                }
+                else if (fd == dbfd)
+                {
+                    if (timerNext(dbfd, optDBSeconds) < 0) continue;
+                    
+                    METER_sync(renc);
+                    
+                    write_db(METER_get_position(renc));
+                }
+                else if (rrdc && (fd == RRDC_fd(rrdc)))
+                {
+                    RRDC_io(rrdc, events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR),
+                            events[i].events & EPOLLOUT);
+                    if (spool) spoolSend();
+                    rrdcPoll();
+                }
             }
-
-
+            
             fflush(stdout);
         }
         
         METER_cancel(renc);
         
+        RRDC_cancel(rrdc);
+        
+        SPOOL_cancel(spool);
+        
+        DBS_cancel(dbs);
+        
+#ifdef METER_LIBPIGPIO
+        gpioTerminate();
+#else
         pigpio_stop(pi);
+#endif
     }
     return 0;
 }
 
-void write_db(uint32_t value) {
-//TODO
-    printf("writing to db not yet implemented\n");
+/*
+ The count is stored as meter 0 with the time of the write.  Only the
+ hand over to the database writer thread happens here.
+ */
+
+void write_db(uint64_t value) {
+
+    struct timespec now;
+
+    if (!dbs) return;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    DBS_add(dbs, 0, (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000, value);
+
+    if (DBS_flush(dbs) == 0)
+        printf("writing %" PRIu64 " to db\n", value);
 }
 
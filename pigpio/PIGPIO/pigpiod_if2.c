@@ -70,6 +70,8 @@ struct callback_s
    CBF_t f;
    void * user;
    int ex;
+   int batch;
+   uint32_t bits;
    callback_t *prev;
    callback_t *next;
 };
@@ -85,6 +87,10 @@ static int             gPigNotify   [MAX_PI];
 static uint32_t        gNotifyBits  [MAX_PI];
 static uint32_t        gLastLevel   [MAX_PI];
 
+static int             gNotifySeqOK [MAX_PI];
+static uint16_t        gNotifySeqno [MAX_PI];
+static uint32_t        gNotifyLost  [MAX_PI];
+
 static pthread_t       *gPthNotify  [MAX_PI];
 
 static pthread_mutex_t gCmdMutex    [MAX_PI];
@@ -92,6 +98,7 @@ static int             gCancelState [MAX_PI];
 
 static callback_t *gCallBackFirst = 0;
 static callback_t *gCallBackLast  = 0;
+static int         gCallBackId    = 0;
 
 /* PRIVATE ---------------------------------------------------------------- */
 
@@ -296,7 +303,7 @@ static void dispatch_notification(int pi, gpioReport_t *r)
 
       while (p)
       {
-         if (((p->pi) == pi) && (changed & (1<<(p->gpio))))
+         if (((p->pi) == pi) && !(p->batch) && (changed & (1<<(p->gpio))))
          {
             if ((r->level) & (1<<(p->gpio))) l = 1; else l = 0;
             if ((p->edge) ^ l)
@@ -316,7 +323,7 @@ static void dispatch_notification(int pi, gpioReport_t *r)
 
       while (p)
       {
-         if (((p->pi) == pi) && ((p->gpio) == g))
+         if (((p->pi) == pi) && !(p->batch) && ((p->gpio) == g))
          {
             if (p->ex) (p->f)(pi, g, PI_TIMEOUT, r->tick, p->user);
             else       (p->f)(pi, g, PI_TIMEOUT, r->tick);
@@ -326,6 +333,20 @@ static void dispatch_notification(int pi, gpioReport_t *r)
    }
 }
 
+static void dispatch_batch(int pi, gpioReport_t *r, unsigned count)
+{
+   callback_t *p;
+
+   p = gCallBackFirst;
+
+   while (p)
+   {
+      if (((p->pi) == pi) && (p->batch))
+         (p->f)(pi, r, count, p->user);
+      p = p->next;
+   }
+}
+
 static void *pthNotifyThread(void *x)
 {
    static int got = 0;
@@ -347,6 +368,15 @@ static void *pthNotifyThread(void *x)
 
       while (got >= sizeof(gpioReport_t))
       {
+         /* a gap in the sequence numbers means reports were dropped */
+
+         if (gNotifySeqOK[pi])
+            gNotifyLost[pi] +=
+               (uint16_t)(report[r].seqno - gNotifySeqno[pi] - 1);
+
+         gNotifySeqno[pi] = report[r].seqno;
+         gNotifySeqOK[pi] = 1;
+
          dispatch_notification(pi, &report[r]);
 
          r++;
@@ -354,6 +384,8 @@ static void *pthNotifyThread(void *x)
          got -= sizeof(gpioReport_t);
       }
 
+      if (r) dispatch_batch(pi, report, r);
+
       /* copy any partial report to start of array */
       
       if (got && r) report[0] = report[r];
@@ -376,7 +408,11 @@ static void findNotifyBits(int pi)
 
    while (p)
    {
-      if (p->pi == pi) bits |= (1<<(p->gpio));
+      if (p->pi == pi)
+      {
+         if (p->batch) bits |= p->bits;
+         else          bits |= (1<<(p->gpio));
+      }
       p = p->next;
    }
 
@@ -396,7 +432,6 @@ static void _wfe(
 static int intCallback(
    int pi, unsigned user_gpio, unsigned edge, void *f, void *user, int ex)
 {
-   static int id = 0;
    callback_t *p;
 
    if ((user_gpio >=0) && (user_gpio < 32) && (edge >=0) && (edge <= 2) && f)
@@ -423,13 +458,15 @@ static int intCallback(
       {
          if (!gCallBackFirst) gCallBackFirst = p;
 
-         p->id = id++;
+         p->id = gCallBackId++;
          p->pi = pi;
          p->gpio = user_gpio;
          p->edge = edge;
          p->f = f;
          p->user = user;
          p->ex = ex;
+         p->batch = 0;
+         p->bits = 0;
          p->next = 0;
          p->prev = gCallBackLast;
 
@@ -447,6 +484,44 @@ static int intCallback(
    return pigif_bad_callback;
 }
 
+static int intCallbackBatch(int pi, uint32_t bits, CBFuncBatch_t f, void *user)
+{
+   callback_t *p;
+
+   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
+      return pigif_unconnected_pi;
+
+   if (!f) return pigif_bad_callback;
+
+   p = malloc(sizeof(callback_t));
+
+   if (p)
+   {
+      if (!gCallBackFirst) gCallBackFirst = p;
+
+      p->id = gCallBackId++;
+      p->pi = pi;
+      p->gpio = -1;
+      p->edge = -1;
+      p->f = (CBF_t)f;
+      p->user = user;
+      p->ex = 1;
+      p->batch = 1;
+      p->bits = bits;
+      p->next = 0;
+      p->prev = gCallBackLast;
+
+      if (p->prev) (p->prev)->next = p;
+      gCallBackLast = p;
+
+      findNotifyBits(pi);
+
+      return p->id;
+   }
+
+   return pigif_bad_malloc;
+}
+
 static int recvMax(int pi, void *buf, int bufsize, int sent)
 {
    uint8_t scratch[4096];
@@ -620,6 +695,9 @@ int pigpio_start(char *addrStr, char *portStr)
          {
             gLastLevel[pi] = read_bank_1(pi);
 
+            gNotifySeqOK[pi] = 0;
+            gNotifyLost[pi] = 0;
+
             /* must be freed by pthNotifyThread */
             userdata = malloc(sizeof(*userdata));
             *userdata = pi;
@@ -1605,6 +1683,16 @@ int callback_ex(
    int pi, unsigned user_gpio, unsigned edge, CBFuncEx_t f, void *user)
    {return intCallback(pi, user_gpio, edge, f, user, 1);}
 
+int callback_batch(int pi, uint32_t bits, CBFuncBatch_t f, void *user)
+   {return intCallbackBatch(pi, bits, f, user);}
+
+uint32_t get_notify_lost(int pi)
+{
+   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi]) return 0;
+
+   return gNotifyLost[pi];
+}
+
 int callback_cancel(unsigned id)
 {
    callback_t *p;
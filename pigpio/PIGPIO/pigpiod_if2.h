@@ -122,6 +122,8 @@ get_servo_pulsewidth       Get the servo pulsewidth in use on a gpio
 
 callback                   Create gpio level change callback
 callback_ex                Create gpio level change callback
+callback_batch             Create gpio report batch callback
+get_notify_lost            Get the number of dropped reports
 callback_cancel            Cancel a callback
 wait_for_edge              Wait for gpio level change
 
@@ -288,6 +290,9 @@ typedef void (*CBFunc_t)
 typedef void (*CBFuncEx_t)
    (int pi, unsigned user_gpio, unsigned level, uint32_t tick, void * user);
 
+typedef void (*CBFuncBatch_t)
+   (int pi, gpioReport_t *reports, unsigned count, void * user);
+
 typedef struct callback_s callback_t;
 
 /*F*/
@@ -2609,13 +2614,58 @@ The callback is called with the gpio, edge, tick, and user, whenever
 the gpio has the identified edge.
 D*/
 
+/*F*/
+int callback_batch(int pi, uint32_t bits, CBFuncBatch_t f, void *userdata);
+/*D
+This function initialises a new batch callback.
+
+. .
+      pi: 0- (as returned by [*pigpio_start*]).
+    bits: a bit mask indicating the gpios of interest.
+       f: the callback function.
+userdata: a pointer to arbitrary user data.
+. .
+
+The function returns a callback id if OK, otherwise pigif_bad_malloc,
+pigif_bad_callback, or pigif_unconnected_pi.
+
+The callback is called once for each block of reports read from
+the notification socket, with the reports, their count, and user.
+The reports are passed unfiltered; the callback must itself work
+out which of the bits gpios changed level (see [*gpioReport_t*]).
+
+This lets a client handle many edges, possibly on many gpios,
+with one function call.
+D*/
+
+/*F*/
+uint32_t get_notify_lost(int pi);
+/*D
+This function returns the number of gpio reports the daemon failed
+to deliver since [*pigpio_start*].
+
+. .
+pi: 0- (as returned by [*pigpio_start*]).
+. .
+
+The daemon numbers the reports it sends.  If it can not write them
+to the notification socket without blocking they are discarded,
+leaving a gap in the numbers.  The gaps are counted by the
+notification thread before the callbacks are called, so a callback
+may compare the count with the value it saw last.
+
+Any level change in a dropped report is lost to every callback.
+The count wraps at 2^32.
+D*/
+
 /*F*/
 int callback_cancel(unsigned callback_id);
 /*D
 This function cancels a callback identified by its id.
 
 . .
-callback_id: >=0, as returned by a call to [*callback*] or [*callback_ex*].
+callback_id: >=0, as returned by a call to [*callback*], [*callback_ex*],
+             or [*callback_batch*].
 . .
 
 The function returns 0 if OK, otherwise pigif_callback_not_found.
@@ -2714,6 +2764,12 @@ typedef void (*CBFuncEx_t)
    (unsigned user_gpio, unsigned level, uint32_t tick, void * user);
 . .
 
+CBFuncBatch_t::
+. .
+typedef void (*CBFuncBatch_t)
+   (int pi, gpioReport_t *reports, unsigned count, void * user);
+. .
+
 char::
 A single character, an 8 bit quantity able to store 0-255.
 